@@ -84,6 +84,7 @@ int main(int argc, const char** argv)
 	}
 
 	rst::rasterizer r(700, 700);
+	r.set_msaa(4);
 
 	Eigen::Vector3f eye_pos = { 0,0,5 };
 
@@ -8,7 +8,12 @@
 #include <algorithm>
 #include <vector>
 #include <math.h>
+#include <stdexcept>
+#include <utility>
 #include <opencv2/opencv.hpp>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f>& positions)
 {
@@ -39,41 +44,116 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
 	return Vector4f(v3.x(), v3.y(), v3.z(), w);
 }
 
-static int insideTriangle(int x, int y, const std::array<Vector4f, 3> _v, int samplesNum)
+// 采样点在像素内的位置，以1/16像素为单位 (D3D的标准样式)
+static const int samplePattern1[1][2] = { { 8, 8 } };
+static const int samplePattern2[2][2] = { { 12, 12 }, { 4, 4 } };
+static const int samplePattern4[4][2] = { { 6, 2 }, { 14, 6 }, { 2, 10 }, { 10, 14 } };
+static const int samplePattern8[8][2] = { { 9, 5 }, { 7, 11 }, { 13, 9 }, { 5, 3 }, { 3, 13 }, { 1, 7 }, { 11, 15 }, { 15, 1 } };
+// 三角形按8x8的像素块遍历
+static constexpr int blockSize = 8;
+
+// Edge functions E_k(x, y) = a[k] * x + b[k] * y + c[k] of a screen triangle, edge k lies
+// opposite vertex k. The edges are oriented so that the inside is where all three are positive.
+struct TriangleEdges
 {
-	// TODO : Implement this function to check if the point (x, y) is inside the triangle represented by _v[0], _v[1], _v[2]
-
-	// 获取点坐标
-	Vector3f A = { _v[0].x(), _v[0].y(), 1.0f };
-	Vector3f B = { _v[1].x(), _v[1].y(), 1.0f };
-	Vector3f C = { _v[2].x(), _v[2].y(), 1.0f };
-
-	// 在给定像素区域内进行多重采样，计算落在三角形内部的采样点数量
-	int count = 0; // 在三角形内的点数
-	for (int i = 0; i < samplesNum; ++i) {
-		float sampleX = x + (static_cast<float>(i) + 0.5f) / static_cast<float>(samplesNum);
-		for (int j = 0; j < samplesNum; ++j) {
-			float sampleY = y + (static_cast<float>(j) + 0.5f) / static_cast<float>(samplesNum);
-
-			Vector3f P = { sampleX, sampleY, 1.0f };
-
-			float result1 = ((B - A).cross(P - A)).z();
-			float result2 = ((C - B).cross(P - B)).z();
-			float result3 = ((A - C).cross(P - C)).z();
+	float a[3], b[3], c[3];
+	// E_k == 0 counts as inside only on top and left edges
+	bool topLeft[3];
+	float invArea; // E_k * invArea is the barycentric coordinate of vertex k
+	float dzdx, dzdy, z0; // depth at (x, y) is z0 + dzdx * x + dzdy * y
+	// E_k and the depth at every sample of a pixel minus their value at its corner
+	alignas(16) float sampleOffset[3][rst::rasterizer::max_samples];
+	alignas(16) float sampleDepth[rst::rasterizer::max_samples];
+};
+
+static bool setupEdges(const std::array<Vector4f, 3>& v, const std::vector<Eigen::Vector2f>& samplePos, TriangleEdges& e)
+{
+	float area = (v[1].x() - v[0].x()) * (v[2].y() - v[0].y()) - (v[2].x() - v[0].x()) * (v[1].y() - v[0].y());
+	if (area == 0)
+		return false;
+	// 顺时针的三角形把边反向，内部总是正的
+	float sign = area > 0 ? 1.0f : -1.0f;
+	for (int k = 0; k < 3; ++k) {
+		int p = (k + 1) % 3, q = (k + 2) % 3;
+		float dx = sign * (v[q].x() - v[p].x()), dy = sign * (v[q].y() - v[p].y());
+		// c从两个端点里固定的那个算，共享这条边的两个三角形的边函数正好互为相反数
+		int o = std::make_pair(v[p].y(), v[p].x()) < std::make_pair(v[q].y(), v[q].x()) ? p : q;
+		e.a[k] = -dy;
+		e.b[k] = dx;
+		e.c[k] = dy * v[o].x() - dx * v[o].y();
+		// Samples exactly on an edge belong to the triangle only if it is a top or a left edge,
+		// so two triangles sharing the edge draw them exactly once.
+		e.topLeft[k] = dy < 0 || (dy == 0 && dx < 0);
+		for (int s = 0; s < rst::rasterizer::max_samples; ++s)
+			e.sampleOffset[k][s] = s < (int)samplePos.size() ? e.a[k] * samplePos[s].x() + e.b[k] * samplePos[s].y() : 0.0f;
+	}
+	e.invArea = 1.0f / (area * sign);
+	// 深度在屏幕上是线性的, 齐次除法之后w都是1
+	e.dzdx = (e.a[0] * v[0].z() + e.a[1] * v[1].z() + e.a[2] * v[2].z()) * e.invArea;
+	e.dzdy = (e.b[0] * v[0].z() + e.b[1] * v[1].z() + e.b[2] * v[2].z()) * e.invArea;
+	e.z0 = (e.c[0] * v[0].z() + e.c[1] * v[1].z() + e.c[2] * v[2].z()) * e.invArea;
+	for (int s = 0; s < rst::rasterizer::max_samples; ++s)
+		e.sampleDepth[s] = s < (int)samplePos.size() ? e.dzdx * samplePos[s].x() + e.dzdy * samplePos[s].y() : 0.0f;
+	return true;
+}
 
-			if (result1 < 0 && result2 < 0 && result3 < 0 || result1 > 0 && result2 > 0 && result3 > 0)
-				++count;
+// 像素(x, y)中落在三角形内部的采样点，第s位对应第s个采样点
+static uint32_t insideTriangle(int x, int y, const TriangleEdges& e, int samples)
+{
+	uint32_t mask = 0;
+#if defined(__SSE2__)
+	// 四个采样点一起测试
+	for (int s = 0; s < samples; s += 4) {
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (int k = 0; k < 3; ++k) {
+			__m128 corner = _mm_set1_ps(e.a[k] * x + e.b[k] * y + e.c[k]);
+			__m128 E = _mm_add_ps(corner, _mm_load_ps(&e.sampleOffset[k][s]));
+			inside = _mm_and_ps(inside, e.topLeft[k] ? _mm_cmpge_ps(E, _mm_setzero_ps()) : _mm_cmpgt_ps(E, _mm_setzero_ps()));
+		}
+		mask |= _mm_movemask_ps(inside) << s;
+	}
+#else
+	for (int s = 0; s < samples; ++s) {
+		bool inside = true;
+		for (int k = 0; k < 3; ++k) {
+			float E = e.a[k] * x + e.b[k] * y + e.c[k] + e.sampleOffset[k][s];
+			inside &= e.topLeft[k] ? E >= 0 : E > 0;
 		}
+		mask |= (uint32_t)inside << s;
 	}
-	return count;
+#endif
+	return mask & ((1u << samples) - 1);
 }
 
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector3f* v)
+// 对mask里的采样点做深度测试，更新通过的采样点的深度，返回通过的采样点
+static uint32_t depthTest(float* depth, float z, uint32_t mask, const TriangleEdges& e, int samples)
 {
-	float c1 = (x * (v[1].y() - v[2].y()) + (v[2].x() - v[1].x()) * y + v[1].x() * v[2].y() - v[2].x() * v[1].y()) / (v[0].x() * (v[1].y() - v[2].y()) + (v[2].x() - v[1].x()) * v[0].y() + v[1].x() * v[2].y() - v[2].x() * v[1].y());
-	float c2 = (x * (v[2].y() - v[0].y()) + (v[0].x() - v[2].x()) * y + v[2].x() * v[0].y() - v[0].x() * v[2].y()) / (v[1].x() * (v[2].y() - v[0].y()) + (v[0].x() - v[2].x()) * v[1].y() + v[2].x() * v[0].y() - v[0].x() * v[2].y());
-	float c3 = (x * (v[0].y() - v[1].y()) + (v[1].x() - v[0].x()) * y + v[0].x() * v[1].y() - v[1].x() * v[0].y()) / (v[2].x() * (v[0].y() - v[1].y()) + (v[1].x() - v[0].x()) * v[2].y() + v[0].x() * v[1].y() - v[1].x() * v[0].y());
-	return { c1,c2,c3 };
+	uint32_t passed = 0;
+#if defined(__SSE2__)
+	if (samples >= 4) {
+		const __m128i bit = _mm_setr_epi32(1, 2, 4, 8);
+		for (int s = 0; s < samples; s += 4) {
+			__m128 zs = _mm_add_ps(_mm_set1_ps(z), _mm_load_ps(&e.sampleDepth[s]));
+			__m128 old = _mm_loadu_ps(depth + s);
+			__m128 covered = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(mask >> s), bit), bit));
+			__m128 closer = _mm_and_ps(covered, _mm_cmplt_ps(zs, old));
+			_mm_storeu_ps(depth + s, _mm_or_ps(_mm_and_ps(closer, zs), _mm_andnot_ps(closer, old)));
+			passed |= _mm_movemask_ps(closer) << s;
+		}
+		return passed;
+	}
+#endif
+	for (uint32_t m = mask; m; m &= m - 1) {
+		int s = 0;
+		while (!(m >> s & 1))
+			++s;
+		float zs = z + e.sampleDepth[s];
+		if (depth[s] > zs) {
+			depth[s] = zs;
+			passed |= 1u << s;
+		}
+	}
+	return passed;
 }
 
 void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
@@ -86,6 +166,8 @@ void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf
 	float f2 = (50 + 0.1) / 2.0;
 
 	Eigen::Matrix4f mvp = projection * view * model;
+	dirty_min = { width, height };
+	dirty_max = { -1, -1 };
 	for (auto& i : ind)
 	{
 		Triangle t;
@@ -123,6 +205,7 @@ void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf
 
 		rasterize_triangle(t);
 	}
+	resolve();
 }
 
 //Screen space rasterization
@@ -137,40 +220,118 @@ void rst::rasterizer::rasterize_triangle(const Triangle& t)
 	//z_interpolated *= w_reciprocal;
 	// TODO : set the current pixel (use the set_pixel function) to the color of the triangle (use getColor function) if it should be painted.
 
-	// 寻找上下左右边界，创建boundingbox
 	auto v = t.toVector4();
-	float xMax = v[0].x(), xMin = v[0].x();
-	if (xMax < v[1].x()) { xMax = v[1].x(); }
-	if (xMax < v[2].x()) { xMax = v[2].x(); }
-	if (xMin > v[1].x()) { xMin = v[1].x(); }
-	if (xMin > v[2].x()) { xMin = v[2].x(); }
-	float yMax = v[0].y(), yMin = v[0].y();
-	if (yMax < v[1].y()) { yMax = v[1].y(); }
-	if (yMax < v[2].y()) { yMax = v[2].y(); }
-	if (yMin > v[1].y()) { yMin = v[1].y(); }
-	if (yMin > v[2].y()) { yMin = v[2].y(); }
-
-	// 遍历boundingbox中的点
-	for (int x = xMin; x <= xMax; ++x) {
-		for (int y = yMin; y <= yMax; ++y) {
-
-			int samplesNum = 2;
-			int count = insideTriangle(x, y, v, samplesNum);
-			if (count) {
-				// 深度插值
-				auto [alpha, beta, gamma] = computeBarycentric2D(x, y, t.v);
-				float w_reciprocal = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-				float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-				z_interpolated *= w_reciprocal;
-				// 比较深度
-				int index = get_index(x, y);
-				if (depth_buf[index] > z_interpolated) {
-					depth_buf[index] = z_interpolated;
-					float coverage = static_cast<float>(count) / (samplesNum * samplesNum);
-					set_pixel({ (float)x, (float)y, 0.0f }, t.getColor() * coverage);
+	TriangleEdges e;
+	if (!setupEdges(v, sample_pos, e))
+		return;
+
+	// 寻找上下左右边界，创建boundingbox，并裁剪到屏幕内
+	float xMin = std::min({ v[0].x(), v[1].x(), v[2].x() }), xMax = std::max({ v[0].x(), v[1].x(), v[2].x() });
+	float yMin = std::min({ v[0].y(), v[1].y(), v[2].y() }), yMax = std::max({ v[0].y(), v[1].y(), v[2].y() });
+	int xBegin = std::max(0, (int)std::floor(xMin)), xEnd = std::min(width - 1, (int)std::floor(xMax));
+	int yBegin = std::max(0, (int)std::floor(yMin)), yEnd = std::min(height - 1, (int)std::floor(yMax));
+	if (xBegin > xEnd || yBegin > yEnd)
+		return;
+	dirty_min = dirty_min.cwiseMin(Eigen::Vector2i(xBegin, yBegin));
+	dirty_max = dirty_max.cwiseMax(Eigen::Vector2i(xEnd, yEnd));
+
+	const Eigen::Vector3f color = t.getColor();
+	const std::array<uint8_t, 3> color8 = { (uint8_t)std::lround(color[0]), (uint8_t)std::lround(color[1]), (uint8_t)std::lround(color[2]) };
+	const uint32_t allSamples = (1u << samples) - 1;
+
+	// 遍历boundingbox中的8x8像素块。整块都在某条边外的直接跳过，
+	// 整块都在三角形内的不用再逐个采样
+	const float s0 = 1.0f / 16, s1 = blockSize - s0;
+	for (int by = yBegin - yBegin % blockSize; by <= yEnd; by += blockSize) {
+		for (int bx = xBegin - xBegin % blockSize; bx <= xEnd; bx += blockSize) {
+			bool outside = false, covered = true;
+			for (int k = 0; k < 3; ++k) {
+				// 块内采样点上边函数的最大值和最小值
+				float hi = e.a[k] * (bx + (e.a[k] > 0 ? s1 : s0)) + e.b[k] * (by + (e.b[k] > 0 ? s1 : s0)) + e.c[k];
+				float lo = e.a[k] * (bx + (e.a[k] > 0 ? s0 : s1)) + e.b[k] * (by + (e.b[k] > 0 ? s0 : s1)) + e.c[k];
+				outside |= e.topLeft[k] ? hi < 0 : hi <= 0;
+				covered &= e.topLeft[k] ? lo >= 0 : lo > 0;
+			}
+			if (outside)
+				continue;
+
+			for (int y = std::max(by, yBegin); y <= std::min(by + blockSize - 1, yEnd); ++y) {
+				for (int x = std::max(bx, xBegin); x <= std::min(bx + blockSize - 1, xEnd); ++x) {
+					uint32_t mask = covered ? allSamples : insideTriangle(x, y, e, samples);
+					if (!mask)
+						continue;
+					// 每个采样点单独比较深度
+					int index = get_index(x, y);
+					float z = e.z0 + e.dzdx * x + e.dzdy * y;
+					uint32_t passed = depthTest(&depth_buf[index * samples], z, mask, e, samples);
+					if (passed)
+						write_samples(msaa_buf[index], passed, color8);
 				}
 			}
+		}
+	}
+}
 
+std::array<uint8_t, 3>& rst::rasterizer::pixel_color(msaa_pixel& p, int i)
+{
+	return i < msaa_pixel::inline_colors ? p.colors[i] : overflow_colors[p.overflow + i - msaa_pixel::inline_colors];
+}
+
+void rst::rasterizer::write_samples(msaa_pixel& p, uint32_t mask, const std::array<uint8_t, 3>& color)
+{
+	// 所有采样点都被覆盖，只剩这一种颜色
+	if (mask == (1u << samples) - 1) {
+		p.fmask = 0;
+		p.color_count = 1;
+		p.colors[0] = color;
+		return;
+	}
+
+	// 没被覆盖的采样点还在用的颜色
+	uint32_t used = 0;
+	for (int s = 0; s < samples; ++s)
+		if (!(mask >> s & 1))
+			used |= 1u << (p.fmask >> 4 * s & 0xf);
+
+	// 先找相同的颜色，再找没人用的位置，最后才加一个新颜色。
+	// 没被覆盖的采样点最多用samples - 1种颜色，所以颜色数不会超过samples
+	int index = -1;
+	for (int i = 0; i < p.color_count && index < 0; ++i)
+		if (used >> i & 1 && pixel_color(p, i) == color)
+			index = i;
+	for (int i = 0; i < p.color_count && index < 0; ++i)
+		if (!(used >> i & 1))
+			index = i;
+	if (index < 0) {
+		index = p.color_count++;
+		if (index >= msaa_pixel::inline_colors && p.overflow < 0) {
+			p.overflow = overflow_colors.size();
+			overflow_colors.resize(overflow_colors.size() + samples - msaa_pixel::inline_colors);
+		}
+	}
+	pixel_color(p, index) = color;
+
+	for (int s = 0; s < samples; ++s)
+		if (mask >> s & 1)
+			p.fmask = (p.fmask & ~(0xfu << 4 * s)) | (uint32_t)index << 4 * s;
+}
+
+void rst::rasterizer::resolve()
+{
+	// 只有这次draw画到的区域会变
+	for (int y = dirty_min.y(); y <= dirty_max.y(); ++y) {
+		for (int i = get_index(dirty_min.x(), y), end = i + dirty_max.x() - dirty_min.x(); i <= end; ++i) {
+			msaa_pixel& p = msaa_buf[i];
+			if (p.color_count == 1) {
+				frame_buf[i] = Eigen::Vector3f(p.colors[0][0], p.colors[0][1], p.colors[0][2]);
+				continue;
+			}
+			Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+			for (int s = 0; s < samples; ++s) {
+				const auto& c = pixel_color(p, p.fmask >> 4 * s & 0xf);
+				sum += Eigen::Vector3f(c[0], c[1], c[2]);
+			}
+			frame_buf[i] = sum / samples;
 		}
 	}
 }
@@ -195,6 +356,13 @@ void rst::rasterizer::clear(rst::Buffers buff)
 	if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
 	{
 		std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{ 0, 0, 0 });
+		msaa_pixel black;
+		black.fmask = 0;
+		black.overflow = -1;
+		black.color_count = 1;
+		black.colors[0] = { 0, 0, 0 };
+		std::fill(msaa_buf.begin(), msaa_buf.end(), black);
+		overflow_colors.clear();
 	}
 	if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
 	{
@@ -205,7 +373,26 @@ void rst::rasterizer::clear(rst::Buffers buff)
 rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
 {
 	frame_buf.resize(w * h);
-	depth_buf.resize(w * h);
+	msaa_buf.resize(w * h);
+	set_msaa(1);
+}
+
+void rst::rasterizer::set_msaa(int n)
+{
+	const int(*pattern)[2];
+	switch (n) {
+	case 1: pattern = samplePattern1; break;
+	case 2: pattern = samplePattern2; break;
+	case 4: pattern = samplePattern4; break;
+	case 8: pattern = samplePattern8; break;
+	default: throw std::runtime_error("MSAA supports 1, 2, 4 or 8 samples per pixel");
+	}
+	samples = n;
+	sample_pos.resize(n);
+	for (int s = 0; s < n; ++s)
+		sample_pos[s] = Eigen::Vector2f(pattern[s][0] / 16.0f, pattern[s][1] / 16.0f);
+	depth_buf.resize(width * height * samples);
+	clear(Buffers::Color | Buffers::Depth);
 }
 
 int rst::rasterizer::get_index(int x, int y)
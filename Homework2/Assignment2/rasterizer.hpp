@@ -9,6 +9,8 @@
 
 #include <eigen3/Eigen/Eigen>
 #include <algorithm>
+#include <array>
+#include <cstdint>
 using namespace Eigen;
 
 namespace rst
@@ -71,6 +73,11 @@ namespace rst
 
         void clear(Buffers buff);
 
+        // Multisample anti-aliasing with 1, 2, 4 or 8 samples per pixel, clears the buffers.
+        // Depth is kept per sample, and draw() resolves the samples into frame_buffer().
+        void set_msaa(int samples);
+        static constexpr int max_samples = 8;
+
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
 
         std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
@@ -80,6 +87,26 @@ namespace rst
 
         void rasterize_triangle(const Triangle& t);
 
+        // Color samples of a pixel, compressed. Most pixels are covered by one or two
+        // triangles, so instead of a color per sample they keep their distinct colors and
+        // a 4 bit index into them per sample. Colors past inline_colors continue in
+        // overflow_colors, which a pixel only gets when it needs them.
+        struct msaa_pixel
+        {
+            static constexpr int inline_colors = 2;
+            uint32_t fmask;      // bits 4 * s to 4 * s + 3: color index of sample s
+            int overflow;        // first of the pixel's samples - inline_colors entries in overflow_colors, or -1
+            uint8_t color_count;
+            std::array<uint8_t, 3> colors[inline_colors];
+        };
+        std::array<uint8_t, 3>& pixel_color(msaa_pixel& p, int i);
+        // Give the samples in mask the color, after they passed the depth test
+        void write_samples(msaa_pixel& p, uint32_t mask, const std::array<uint8_t, 3>& color);
+        // Average the samples of every pixel the last draw() touched into frame_buf
+        void resolve();
+        // pixels covered by the bounding boxes of the triangles in the last draw()
+        Eigen::Vector2i dirty_min, dirty_max;
+
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
     private:
@@ -93,7 +120,13 @@ namespace rst
 
         std::vector<Eigen::Vector3f> frame_buf;
 
+        // samples depths per pixel
         std::vector<float> depth_buf;
+        std::vector<msaa_pixel> msaa_buf;
+        std::vector<std::array<uint8_t, 3>> overflow_colors;
+        int samples;
+        // sample positions inside the pixel, between 0 and 1
+        std::vector<Eigen::Vector2f> sample_pos;
         int get_index(int x, int y);
 
         int width, height;
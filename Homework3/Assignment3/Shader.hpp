@@ -14,11 +14,13 @@ struct fragment_shader_payload
 	fragment_shader_payload()
 	{
 		texture = nullptr;
+		tex_dx = tex_dy = Eigen::Vector2f::Zero();
 	}
 
 	fragment_shader_payload(const Eigen::Vector3f& col, const Eigen::Vector3f& nor, const Eigen::Vector2f& tc, Texture* tex)
 		: color(col), normal(nor), tex_coords(tc), texture(tex)
 	{
+		tex_dx = tex_dy = Eigen::Vector2f::Zero();
 	}
 
 
@@ -26,6 +28,8 @@ struct fragment_shader_payload
 	Eigen::Vector3f color;
 	Eigen::Vector3f normal;
 	Eigen::Vector2f tex_coords;
+	// change of tex_coords from this pixel to the next one in x and in y, for texture filtering
+	Eigen::Vector2f tex_dx, tex_dy;
 	Texture* texture;
 };
 
@@ -4,33 +4,116 @@
 
 #include "Texture.hpp"
 
+#include <cmath>
+
 static Eigen::Vector3f getColorlinear(float distance, Eigen::Vector3f color1, Eigen::Vector3f color2)
 {
 	return (1 - distance) * color1 + distance * color2;
 }
 
-Eigen::Vector3f Texture::getColorBilinear(float u, float v)
+void Texture::build_mip_levels(const cv::Mat& image)
 {
-	Eigen::Vector2f u00 = { (int)(u * width), (int)(v * height) };
-	Eigen::Vector2f u01 = u00;
-	Eigen::Vector2f u10 = u00;
-	Eigen::Vector2f u11 = u00;
-
-	if (u00[0] + 1 < width) {
-		u10[0] = u00[0] + 1;
-		u11[0] = u00[0] + 1;
+	auto allocate = [](mip_level& l, int w, int h)
+	{
+		l.width = w;
+		l.height = h;
+		l.tiles_x = (w + 3) / 4;
+		l.texels.resize(l.tiles_x * ((h + 3) / 4) * 16);
+	};
+
+	levels.clear();
+	levels.emplace_back();
+	allocate(levels[0], width, height);
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			const cv::Vec3b& color = image.at<cv::Vec3b>(y, x);
+			levels[0].texel(x, y) = { color[0], color[1], color[2], 255 };
+		}
 	}
-	if (u00[1] + 1 < height) {
-		u01[1] = u00[1] + 1;
-		u11[1] = u00[1] + 1;
+
+	// Every level averages 2x2 texels of the one before, odd sizes reuse the last row or column
+	while (levels.back().width > 1 || levels.back().height > 1) {
+		const mip_level& src = levels.back();
+		mip_level dst;
+		allocate(dst, std::max(1, src.width / 2), std::max(1, src.height / 2));
+		for (int y = 0; y < dst.height; ++y) {
+			for (int x = 0; x < dst.width; ++x) {
+				int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+				int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+				std::array<uint8_t, 4> avg;
+				for (int c = 0; c < 4; ++c) {
+					int sum = src.texel(x0, y0)[c] + src.texel(x1, y0)[c] + src.texel(x0, y1)[c] + src.texel(x1, y1)[c];
+					avg[c] = (sum + 2) / 4;
+				}
+				dst.texel(x, y) = avg;
+			}
+		}
+		levels.push_back(std::move(dst));
 	}
+}
+
+Eigen::Vector3f Texture::bilinear(int level, float u, float v) const
+{
+	const mip_level& l = levels[level];
+
+	// texel centers are at half integer coordinates
+	float x = u * l.width - 0.5f;
+	float y = (1 - v) * l.height - 0.5f;
+	float fx = std::floor(x), fy = std::floor(y);
+	float s = x - fx, t = y - fy;
+	int x0 = std::clamp((int)fx, 0, l.width - 1), x1 = std::clamp((int)fx + 1, 0, l.width - 1);
+	int y0 = std::clamp((int)fy, 0, l.height - 1), y1 = std::clamp((int)fy + 1, 0, l.height - 1);
+
+	auto color = [&](int x, int y)
+	{
+		const auto& c = l.texel(x, y);
+		return Eigen::Vector3f(c[0], c[1], c[2]);
+	};
+	Eigen::Vector3f u0_color = getColorlinear(s, color(x0, y0), color(x1, y0));
+	Eigen::Vector3f u1_color = getColorlinear(s, color(x0, y1), color(x1, y1));
+	return getColorlinear(t, u0_color, u1_color);
+}
+
+Eigen::Vector3f Texture::trilinear(float lod, float u, float v) const
+{
+	lod = std::clamp(lod, 0.0f, (float)levels.size() - 1);
+	int level = (int)lod;
+	float t = lod - level;
+	if (t == 0 || level + 1 == (int)levels.size())
+		return bilinear(level, u, v);
+	return getColorlinear(t, bilinear(level, u, v), bilinear(level + 1, u, v));
+}
+
+Eigen::Vector3f Texture::getColorBilinear(float u, float v) const
+{
+	return bilinear(0, u, v);
+}
 
-	float s = u - u00[0] / width;
-	Eigen::Vector3f u0_color = getColorlinear(s, getColor(u00[0] / width, u00[1] / height), getColor(u01[0] / width, u01[1] / height));
-	Eigen::Vector3f u1_color = getColorlinear(s, getColor(u10[0] / width, u10[1] / height), getColor(u11[0] / width, u11[1] / height));
+Eigen::Vector3f Texture::getColorTrilinear(float u, float v, const Eigen::Vector2f& tex_dx, const Eigen::Vector2f& tex_dy) const
+{
+	// size of the pixel footprint in texels of the full resolution image
+	Eigen::Vector2f scale(width, height);
+	float rho = std::max(tex_dx.cwiseProduct(scale).norm(), tex_dy.cwiseProduct(scale).norm());
+	return trilinear(std::log2(std::max(rho, 1.0f)), u, v);
+}
 
-	float t = v - u00[1] / height;
-	Eigen::Vector3f result_color = getColorlinear(t, u0_color, u1_color);
+Eigen::Vector3f Texture::getColorAnisotropic(float u, float v, const Eigen::Vector2f& tex_dx, const Eigen::Vector2f& tex_dy) const
+{
+	Eigen::Vector2f scale(width, height);
+	Eigen::Vector2f dx = tex_dx.cwiseProduct(scale), dy = tex_dy.cwiseProduct(scale);
+	float len_x = dx.norm(), len_y = dy.norm();
+	Eigen::Vector2f major = len_x >= len_y ? tex_dx : tex_dy;
+	float major_len = std::max(len_x, len_y), minor_len = std::min(len_x, len_y);
 
-	return result_color;
+	// One sample per minor axis length along the major axis, at the level of the minor axis
+	int samples = std::min(max_anisotropy, (int)std::ceil(major_len / std::max(minor_len, 1e-6f)));
+	samples = std::max(samples, 1);
+	float lod = std::log2(std::max(major_len / samples, 1.0f));
+
+	Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+	for (int i = 0; i < samples; ++i) {
+		float offset = (i + 0.5f) / samples - 0.5f;
+		sum += trilinear(lod, u + offset * major.x(), v + offset * major.y());
+	}
+	return sum / samples;
 }
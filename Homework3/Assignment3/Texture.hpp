@@ -7,34 +7,74 @@
 
 #include "global.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
 #include <eigen3/Eigen/Eigen>
 #include <opencv2/opencv.hpp>
 
+/*
+ * The image is converted at load time into a mip pyramid, each level half the size of
+ * the one before down to 1x1. Texels are RGBA8 and stored in 4x4 tiles, so the 2x2
+ * texels of a bilinear lookup are usually in the same 64 byte cache line.
+ *
+ * Texture coordinates are clamped to the edge. The filtered lookups take the change of
+ * (u, v) from one pixel to the next in x and in y, which the rasterizer puts into
+ * fragment_shader_payload::tex_dx and tex_dy.
+ * */
 class Texture
 {
 private:
-	cv::Mat image_data;
+	struct mip_level
+	{
+		int width, height;
+		int tiles_x;
+		std::vector<std::array<uint8_t, 4>> texels;
+
+		int index(int x, int y) const { return ((y >> 2) * tiles_x + (x >> 2)) * 16 + (y & 3) * 4 + (x & 3); }
+		std::array<uint8_t, 4>& texel(int x, int y) { return texels[index(x, y)]; }
+		const std::array<uint8_t, 4>& texel(int x, int y) const { return texels[index(x, y)]; }
+	};
+	std::vector<mip_level> levels;
+
+	// Largest number of samples an anisotropic lookup takes along the footprint
+	static constexpr int max_anisotropy = 16;
+
+	void build_mip_levels(const cv::Mat& image);
+	Eigen::Vector3f bilinear(int level, float u, float v) const;
+	// Bilinear in the two levels around the fractional level lod
+	Eigen::Vector3f trilinear(float lod, float u, float v) const;
 
 public:
 	Texture(const std::string& name)
 	{
-		image_data = cv::imread(name);
+		cv::Mat image_data = cv::imread(name);
 		cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
 		width = image_data.cols;
 		height = image_data.rows;
+		build_mip_levels(image_data);
 	}
 
 	int width, height;
 
-	Eigen::Vector3f getColor(float u, float v)
+	// Nearest texel of the full resolution image
+	Eigen::Vector3f getColor(float u, float v) const
 	{
-		auto u_img = u * width;
-		auto v_img = (1 - v) * height;
-		auto color = image_data.at<cv::Vec3b>(v_img, u_img);
+		const mip_level& l = levels[0];
+		int x = std::clamp((int)(u * width), 0, width - 1);
+		int y = std::clamp((int)((1 - v) * height), 0, height - 1);
+		const auto& color = l.texel(x, y);
 		return Eigen::Vector3f(color[0], color[1], color[2]);
 	}
 
-	Eigen::Vector3f getColorBilinear(float u, float v);
+	// Bilinear filtering of the full resolution image
+	Eigen::Vector3f getColorBilinear(float u, float v) const;
+	// Bilinear filtering in the two mip levels closest to the pixel footprint, blended
+	Eigen::Vector3f getColorTrilinear(float u, float v, const Eigen::Vector2f& tex_dx, const Eigen::Vector2f& tex_dy) const;
+	// Several trilinear samples spread along the long axis of the pixel footprint, at the
+	// level of its short axis. Sharper than trilinear on surfaces seen at a grazing angle.
+	Eigen::Vector3f getColorAnisotropic(float u, float v, const Eigen::Vector2f& tex_dx, const Eigen::Vector2f& tex_dy) const;
 };
 
 #endif //RASTERIZER_TEXTURE_H
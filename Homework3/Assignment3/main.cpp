@@ -3,9 +3,14 @@
 #include "Triangle.hpp"
 #include "Shader.hpp"
 #include "Texture.hpp"
-#include "OBJ_Loader.h"
+#include "ObjLoader.hpp"
 
+#include <array>
+#include <chrono>
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
 #include <opencv2/opencv.hpp>
 
 Eigen::Matrix4f get_view_matrix(Eigen::Vector3f eye_pos)
@@ -165,7 +170,9 @@ Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
 		// TODO: Get the texture value at the texture coordinates of the current fragment
 
 		// return_color = payload.texture->getColor(payload.tex_coords[0], payload.tex_coords[1]);
-		return_color = payload.texture->getColorBilinear(payload.tex_coords[0], payload.tex_coords[1]);
+		// return_color = payload.texture->getColorBilinear(payload.tex_coords[0], payload.tex_coords[1]);
+		// return_color = payload.texture->getColorTrilinear(payload.tex_coords[0], payload.tex_coords[1], payload.tex_dx, payload.tex_dy);
+		return_color = payload.texture->getColorAnisotropic(payload.tex_coords[0], payload.tex_coords[1], payload.tex_dx, payload.tex_dy);
 	}
 	Eigen::Vector3f texture_color;
 	texture_color << return_color.x(), return_color.y(), return_color.z();
@@ -246,7 +253,7 @@ Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
 	float x = normal[0];
 	float y = normal[1];
 	float z = normal[2];
-	Eigen::Vector3f tangent = { x * y / sqrt(x * x + z * z), sqrt(x * x + z * z), z * y / sqrt(x * x + z * z) };
+	Eigen::Vector3f tangent = { x * y / std::sqrt(x * x + z * z), std::sqrt(x * x + z * z), z * y / std::sqrt(x * x + z * z) };
 	Eigen::Vector3f bitangent = normal.cross(tangent);
 	Eigen::Matrix3f TBN;
 	TBN << tangent[0], bitangent[0], normal[0],
@@ -306,7 +313,7 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
 	float x = normal[0];
 	float y = normal[1];
 	float z = normal[2];
-	Eigen::Vector3f tangent = { x * y / sqrt(x * x + z * z), sqrt(x * x + z * z), z * y / sqrt(x * x + z * z) };
+	Eigen::Vector3f tangent = { x * y / std::sqrt(x * x + z * z), std::sqrt(x * x + z * z), z * y / std::sqrt(x * x + z * z) };
 	Eigen::Vector3f bitangent = normal.cross(tangent);
 	Eigen::Matrix3f TBN;
 	TBN << tangent[0], bitangent[0], normal[0],
@@ -350,36 +357,148 @@ Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payl
 	return result_color * 255.f;
 }
 
-int main(int argc, const char** argv)
+// Indexed vertex buffers of a mesh, as loaded into the rasterizer
+struct Mesh
+{
+	std::vector<Eigen::Vector3f> positions;
+	std::vector<Eigen::Vector3f> normals;
+	std::vector<Eigen::Vector2f> texcoords;
+	std::vector<Eigen::Vector3f> colors;
+	std::vector<Eigen::Vector3i> indices;
+};
+
+// Load an .obj file as an indexed mesh, and as a triangle list too if TriangleList is given.
+// Files without normals get smooth ones, the area weighted average of the face normals.
+void load_obj(const std::string& filename, Mesh& mesh, std::vector<Triangle*>* TriangleList = nullptr)
+{
+	ObjMesh obj;
+	if (!LoadObj(filename, obj))
+		throw std::runtime_error("cannot load " + filename);
+
+	size_t count = obj.vertexCount();
+	mesh.positions.resize(count);
+	mesh.normals.assign(count, Eigen::Vector3f::Zero());
+	mesh.texcoords.assign(count, Eigen::Vector2f::Zero());
+	mesh.colors.assign(count, Eigen::Vector3f(148, 121.0, 92.0));
+	mesh.indices.resize(obj.triangleCount());
+	for (size_t i = 0; i < count; ++i)
+	{
+		mesh.positions[i] = Eigen::Vector3f(obj.px[i], obj.py[i], obj.pz[i]);
+		if (!obj.nx.empty())
+			mesh.normals[i] = Eigen::Vector3f(obj.nx[i], obj.ny[i], obj.nz[i]);
+		if (!obj.u.empty())
+			mesh.texcoords[i] = Eigen::Vector2f(obj.u[i], obj.v[i]);
+	}
+	for (size_t i = 0; i < mesh.indices.size(); ++i)
+		mesh.indices[i] = Eigen::Vector3i(obj.indices[i * 3], obj.indices[i * 3 + 1], obj.indices[i * 3 + 2]);
+
+	if (obj.nx.empty())
+	{
+		for (const Eigen::Vector3i& index : mesh.indices)
+		{
+			Eigen::Vector3f n = (mesh.positions[index[1]] - mesh.positions[index[0]]).cross(mesh.positions[index[2]] - mesh.positions[index[0]]);
+			for (int j = 0;j < 3;j++)
+				mesh.normals[index[j]] += n;
+		}
+		for (Eigen::Vector3f& n : mesh.normals)
+			n.normalize();
+	}
+
+	if (!TriangleList)
+		return;
+	for (const Eigen::Vector3i& index : mesh.indices)
+	{
+		Triangle* t = new Triangle();
+		for (int j = 0;j < 3;j++)
+		{
+			t->setVertex(j, mesh.positions[index[j]].homogeneous());
+			t->setNormal(j, mesh.normals[index[j]]);
+			t->setTexCoord(j, mesh.texcoords[index[j]]);
+		}
+		TriangleList->push_back(t);
+	}
+}
+
+template <typename Draw>
+double time_draw(rst::rasterizer& r, Draw&& draw)
+{
+	r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+	auto start = std::chrono::steady_clock::now();
+	draw();
+	std::chrono::duration<double, std::milli> time = std::chrono::steady_clock::now() - start;
+	return time.count();
+}
+
+// Best time of a few draws with the shader called through the std::function, against
+// the same draws with the shader inlined into draw<>. The two alternate, so both see
+// the same machine load.
+template <typename FragmentShader>
+void benchmark_shader(rst::rasterizer& r, rst::pos_buf_id pos_id, rst::ind_buf_id ind_id, rst::col_buf_id col_id, const std::string& name, const FragmentShader& shader)
+{
+	r.set_fragment_shader(shader);
+	double dynamic = std::numeric_limits<double>::infinity(), inlined = dynamic;
+	for (int i = 0; i < 30; ++i)
+	{
+		dynamic = std::min(dynamic, time_draw(r, [&] { r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle); }));
+		inlined = std::min(inlined, time_draw(r, [&] { r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle, shader); }));
+	}
+	std::cout << name << ": std::function " << dynamic << " ms, inlined " << inlined << " ms\n";
+}
+
+// Best time of drawing a mesh as a triangle list, which transforms three vertices per
+// triangle, against the indexed draw with its post-transform cache
+void benchmark_mesh(const std::string& filename, float angle, const Eigen::Vector3f& eye_pos)
 {
 	std::vector<Triangle*> TriangleList;
+	Mesh mesh;
+	load_obj(filename, mesh, &TriangleList);
+
+	rst::rasterizer r(700, 700);
+	auto pos_id = r.load_positions(mesh.positions);
+	auto ind_id = r.load_indices(mesh.indices);
+	auto col_id = r.load_colors(mesh.colors);
+	r.load_normals(mesh.normals);
+	r.load_texcoords(mesh.texcoords);
+	r.set_vertex_shader(vertex_shader);
+	r.set_model(get_model_matrix(angle));
+	r.set_view(get_view_matrix(eye_pos));
+	r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+
+	auto shader = [](const fragment_shader_payload& payload) { return normal_fragment_shader(payload); };
+	double list = std::numeric_limits<double>::infinity(), indexed = list;
+	for (int i = 0; i < 30; ++i)
+	{
+		list = std::min(list, time_draw(r, [&] { r.draw(TriangleList, shader); }));
+		indexed = std::min(indexed, time_draw(r, [&] { r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle, shader); }));
+	}
+	std::cout << filename << ": " << mesh.indices.size() << " triangles, " << mesh.positions.size() << " vertices, triangle list "
+		<< list << " ms, indexed " << indexed << " ms\n";
+
+	for (auto t : TriangleList)
+		delete t;
+}
+
+int main(int argc, const char** argv)
+{
+	Mesh mesh;
 
 	float angle = 140.0;
 	bool command_line = false;
 
 	std::string filename = "output.png";
-	objl::Loader Loader;
 	std::string obj_path = "../models/spot/";
 
 	// Load .obj File
-	bool loadout = Loader.LoadFile("../models/spot/spot_triangulated_good.obj");
-	for (auto mesh : Loader.LoadedMeshes)
-	{
-		for (int i = 0;i < mesh.Vertices.size();i += 3)
-		{
-			Triangle* t = new Triangle();
-			for (int j = 0;j < 3;j++)
-			{
-				t->setVertex(j, Vector4f(mesh.Vertices[i + j].Position.X, mesh.Vertices[i + j].Position.Y, mesh.Vertices[i + j].Position.Z, 1.0));
-				t->setNormal(j, Vector3f(mesh.Vertices[i + j].Normal.X, mesh.Vertices[i + j].Normal.Y, mesh.Vertices[i + j].Normal.Z));
-				t->setTexCoord(j, Vector2f(mesh.Vertices[i + j].TextureCoordinate.X, mesh.Vertices[i + j].TextureCoordinate.Y));
-			}
-			TriangleList.push_back(t);
-		}
-	}
+	load_obj("../models/spot/spot_triangulated_good.obj", mesh);
 
 	rst::rasterizer r(700, 700);
 
+	auto pos_id = r.load_positions(mesh.positions);
+	auto ind_id = r.load_indices(mesh.indices);
+	auto col_id = r.load_colors(mesh.colors);
+	r.load_normals(mesh.normals);
+	r.load_texcoords(mesh.texcoords);
+
 	auto texture_path = "hmap.jpg";
 	r.set_texture(Texture(obj_path + texture_path));
 
@@ -411,11 +530,15 @@ int main(int argc, const char** argv)
 		{
 			std::cout << "Rasterizing using the bump shader\n";
 			active_shader = bump_fragment_shader;
+			// expensive per fragment, shade each visible pixel only once
+			r.set_shading(rst::Shading::Deferred);
 		}
 		else if (argc == 3 && std::string(argv[2]) == "displacement")
 		{
 			std::cout << "Rasterizing using the bump shader\n";
 			active_shader = displacement_fragment_shader;
+			// expensive per fragment, shade each visible pixel only once
+			r.set_shading(rst::Shading::Deferred);
 		}
 	}
 
@@ -423,10 +546,29 @@ int main(int argc, const char** argv)
 
 	r.set_vertex_shader(vertex_shader);
 	r.set_fragment_shader(active_shader);
+	// spot is a closed mesh, its back faces are always hidden
+	r.set_culling(rst::Culling::Back);
 
 	int key = 0;
 	int frame_count = 0;
 
+	if (argc == 2 && std::string(argv[1]) == "benchmark")
+	{
+		r.set_model(get_model_matrix(angle));
+		r.set_view(get_view_matrix(eye_pos));
+		r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
+
+		benchmark_shader(r, pos_id, ind_id, col_id, "normal", [](const fragment_shader_payload& payload) { return normal_fragment_shader(payload); });
+		benchmark_shader(r, pos_id, ind_id, col_id, "phong", [](const fragment_shader_payload& payload) { return phong_fragment_shader(payload); });
+		benchmark_shader(r, pos_id, ind_id, col_id, "texture", [](const fragment_shader_payload& payload) { return texture_fragment_shader(payload); });
+		benchmark_shader(r, pos_id, ind_id, col_id, "bump", [](const fragment_shader_payload& payload) { return bump_fragment_shader(payload); });
+		benchmark_shader(r, pos_id, ind_id, col_id, "displacement", [](const fragment_shader_payload& payload) { return displacement_fragment_shader(payload); });
+
+		benchmark_mesh("../models/spot/spot_triangulated_good.obj", angle, eye_pos);
+		benchmark_mesh("../models/bunny/bunny.obj", angle, eye_pos);
+		return 0;
+	}
+
 	if (command_line)
 	{
 		r.clear(rst::Buffers::Color | rst::Buffers::Depth);
@@ -434,7 +576,7 @@ int main(int argc, const char** argv)
 		r.set_view(get_view_matrix(eye_pos));
 		r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
 
-		r.draw(TriangleList);
+		r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
 		cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
 		image.convertTo(image, CV_8UC3, 1.0f);
 		cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
@@ -452,8 +594,7 @@ int main(int argc, const char** argv)
 		r.set_view(get_view_matrix(eye_pos));
 		r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
 
-		//r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
-		r.draw(TriangleList);
+		r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
 		cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
 		image.convertTo(image, CV_8UC3, 1.0f);
 		cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
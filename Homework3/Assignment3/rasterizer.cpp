@@ -6,7 +6,12 @@
 
 #include <math.h>
 #include <algorithm>
+#include <atomic>
+#include <thread>
 #include <opencv2/opencv.hpp>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f>& positions)
 {
@@ -42,6 +47,16 @@ rst::col_buf_id rst::rasterizer::load_normals(const std::vector<Eigen::Vector3f>
 	return { id };
 }
 
+rst::tex_buf_id rst::rasterizer::load_texcoords(const std::vector<Eigen::Vector2f>& texcoords)
+{
+	auto id = get_next_id();
+	tex_buf.emplace(id, texcoords);
+
+	texcoord_id = id;
+
+	return { id };
+}
+
 
 // Bresenham's line drawing algorithm
 void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
@@ -149,181 +164,398 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
 	return Vector4f(v3.x(), v3.y(), v3.z(), w);
 }
 
-static bool insideTriangle(int x, int y, const Vector4f* _v)
+// Screen coordinates are snapped to 1/256 pixel. Vertices further than 2^20 pixels out
+// are not rasterized, which keeps the edge functions well inside 64 bits. Clipping keeps
+// all vertices closer than that.
+static constexpr int subpixel_bits = 8;
+static constexpr float max_screen_coord = 1 << 20;
+
+bool rst::rasterizer::setup_edges(const Triangle& t, edge_equations& e) const
 {
-	Vector3f v[3];
-	for (int i = 0;i < 3;i++)
-		v[i] = { _v[i].x(),_v[i].y(), 1.0 };
-	Vector3f f0, f1, f2;
-	f0 = v[1].cross(v[0]);
-	f1 = v[2].cross(v[1]);
-	f2 = v[0].cross(v[2]);
-	Vector3f p(x, y, 1.);
-	if ((p.dot(f0) * f0.dot(v[2]) > 0) && (p.dot(f1) * f1.dot(v[0]) > 0) && (p.dot(f2) * f2.dot(v[1]) > 0))
-		return true;
-	return false;
+	int64_t X[3], Y[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		if (!(std::abs(t.v[i].x()) < max_screen_coord && std::abs(t.v[i].y()) < max_screen_coord))
+			return false;
+		X[i] = std::llround(t.v[i].x() * (1 << subpixel_bits));
+		Y[i] = std::llround(t.v[i].y() * (1 << subpixel_bits));
+	}
+
+	int64_t area = (X[1] - X[0]) * (Y[2] - Y[0]) - (X[2] - X[0]) * (Y[1] - Y[0]);
+	if (area == 0)
+		return false;
+	// Counter-clockwise on screen is the front face
+	if ((culling == Culling::Back && area < 0) || (culling == Culling::Front && area > 0))
+		return false;
+	// Clockwise triangles get their edges reversed, so the inside is positive either way
+	int64_t sign = area > 0 ? 1 : -1;
+
+	for (int k = 0; k < 3; ++k)
+	{
+		int p = (k + 1) % 3, q = (k + 2) % 3;
+		int64_t dx = sign * (X[q] - X[p]), dy = sign * (Y[q] - Y[p]);
+		// E_k = dx * (y - Y[p]) - dy * (x - X[p]), with the pixel (x, y) in subpixel units
+		e.a[k] = -dy * (1 << subpixel_bits);
+		e.b[k] = dx * (1 << subpixel_bits);
+		e.c[k] = dy * X[p] - dx * Y[p];
+		// Pixels exactly on an edge belong to the triangle only if it is a top or a left edge,
+		// so two triangles sharing the edge never both draw them. Others are moved in by one.
+		bool top_left = dy < 0 || (dy == 0 && dx < 0);
+		if (!top_left)
+			e.c[k] -= 1;
+	}
+	e.inv_area = 1.0f / (float)(area * sign);
+	e.dzdx = (e.a[0] * t.v[0].z() + e.a[1] * t.v[1].z() + e.a[2] * t.v[2].z()) * e.inv_area;
+	e.dzdy = (e.b[0] * t.v[0].z() + e.b[1] * t.v[1].z() + e.b[2] * t.v[2].z()) * e.inv_area;
+	e.zmin = std::min({ t.v[0].z(), t.v[1].z(), t.v[2].z() });
+
+	// Pixel centers are at integer coordinates
+	int64_t xmin = std::min({ X[0], X[1], X[2] }), xmax = std::max({ X[0], X[1], X[2] });
+	int64_t ymin = std::min({ Y[0], Y[1], Y[2] }), ymax = std::max({ Y[0], Y[1], Y[2] });
+	const int64_t one = 1 << subpixel_bits;
+	e.xmin = (int)std::max<int64_t>(0, (xmin + one - 1) >> subpixel_bits);
+	e.ymin = (int)std::max<int64_t>(0, (ymin + one - 1) >> subpixel_bits);
+	e.xmax = (int)std::min<int64_t>(width - 1, xmax >> subpixel_bits);
+	e.ymax = (int)std::min<int64_t>(height - 1, ymax >> subpixel_bits);
+	return e.xmin <= e.xmax && e.ymin <= e.ymax;
 }
 
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector4f* v)
+void rst::rasterizer::run_threads(int count, const std::function<void(int)>& fn)
 {
-	float c1 = (x * (v[1].y() - v[2].y()) + (v[2].x() - v[1].x()) * y + v[1].x() * v[2].y() - v[2].x() * v[1].y()) / (v[0].x() * (v[1].y() - v[2].y()) + (v[2].x() - v[1].x()) * v[0].y() + v[1].x() * v[2].y() - v[2].x() * v[1].y());
-	float c2 = (x * (v[2].y() - v[0].y()) + (v[0].x() - v[2].x()) * y + v[2].x() * v[0].y() - v[0].x() * v[2].y()) / (v[1].x() * (v[2].y() - v[0].y()) + (v[0].x() - v[2].x()) * v[1].y() + v[2].x() * v[0].y() - v[0].x() * v[2].y());
-	float c3 = (x * (v[0].y() - v[1].y()) + (v[1].x() - v[0].x()) * y + v[0].x() * v[1].y() - v[1].x() * v[0].y()) / (v[2].x() * (v[0].y() - v[1].y()) + (v[1].x() - v[0].x()) * v[2].y() + v[0].x() * v[1].y() - v[1].x() * v[0].y());
-	return { c1,c2,c3 };
+	std::vector<std::thread> threads;
+	for (int i = 1; i < count; ++i)
+		threads.emplace_back(fn, i);
+	fn(0);
+	for (auto& thread : threads)
+		thread.join();
 }
 
-void rst::rasterizer::draw(std::vector<Triangle*>& TriangleList)
+Eigen::Vector4f rst::rasterizer::to_screen(Eigen::Vector4f v) const
 {
-
 	float f1 = (50 - 0.1) / 2.0;
 	float f2 = (50 + 0.1) / 2.0;
 
-	Eigen::Matrix4f mvp = projection * view * model;
-	for (const auto& t : TriangleList)
+	//Homogeneous division
+	v.x() /= v.w();
+	v.y() /= v.w();
+	v.z() /= v.w();
+
+	//Viewport transformation
+	v.x() = 0.5 * width * (v.x() + 1.0);
+	v.y() = 0.5 * height * (v.y() + 1.0);
+	v.z() = v.z() * f1 + f2;
+	return v;
+}
+
+// Clip space is oriented so that w > 0 in front of the camera (see w_sign). Visible
+// points have |x|, |y| <= w, clipping only happens at the guard band |x|, |y| <= g * w,
+// far enough out that setup_edges accepts every vertex inside it.
+enum clip_plane
+{
+	clip_near = 1,
+	clip_left = 2,
+	clip_right = 4,
+	clip_bottom = 8,
+	clip_top = 16
+};
+static constexpr int clip_plane_count = 5;
+static constexpr float near_w = 1e-5f;
+
+static int outcode(const Eigen::Vector4f& p, float g)
+{
+	int code = 0;
+	if (p.w() < near_w) code |= clip_near;
+	if (p.x() < -g * p.w()) code |= clip_left;
+	if (p.x() > g * p.w()) code |= clip_right;
+	if (p.y() < -g * p.w()) code |= clip_bottom;
+	if (p.y() > g * p.w()) code |= clip_top;
+	return code;
+}
+
+// Signed distance of p to a clip plane, negative outside
+static float clip_distance(const Eigen::Vector4f& p, int plane, float g)
+{
+	switch (plane)
 	{
-		Triangle newtri = *t;
-
-		std::array<Eigen::Vector4f, 3> mm{
-			(view * model * t->v[0]),
-			(view * model * t->v[1]),
-			(view * model * t->v[2])
-		};
-
-		std::array<Eigen::Vector3f, 3> viewspace_pos;
-
-		std::transform(mm.begin(), mm.end(), viewspace_pos.begin(), [](auto& v) {
-			return v.template head<3>();
-			});
-
-		Eigen::Vector4f v[] = {
-			mvp * t->v[0],
-			mvp * t->v[1],
-			mvp * t->v[2]
-		};
-		//Homogeneous division
-		for (auto& vec : v) {
-			vec.x() /= vec.w();
-			vec.y() /= vec.w();
-			vec.z() /= vec.w();
+	case clip_near: return p.w() - near_w;
+	case clip_left: return g * p.w() + p.x();
+	case clip_right: return g * p.w() - p.x();
+	case clip_bottom: return g * p.w() + p.y();
+	default: return g * p.w() - p.y();
+	}
+}
+
+static rst::clip_vertex lerp(const rst::clip_vertex& a, const rst::clip_vertex& b, float t)
+{
+	rst::clip_vertex v;
+	v.pos = a.pos + t * (b.pos - a.pos);
+	v.view_pos = a.view_pos + t * (b.view_pos - a.view_pos);
+	v.normal = a.normal + t * (b.normal - a.normal);
+	v.color = a.color + t * (b.color - a.color);
+	v.tex_coords = a.tex_coords + t * (b.tex_coords - a.tex_coords);
+	return v;
+}
+
+void rst::rasterizer::reset_bins()
+{
+	screen_tris.resize(thread_count);
+	for (auto& tris : screen_tris)
+		tris.clear();
+	bins.resize(thread_count * tiles_x * tiles_y);
+	for (auto& bin : bins)
+		bin.clear();
+}
+
+void rst::rasterizer::clip_triangle(int thread, const clip_vertex* v)
+{
+	// Screen coordinates stay below half of max_screen_coord inside the guard band
+	float g = max_screen_coord / std::max(width, height);
+	int codes[3] = { outcode(v[0].pos, g), outcode(v[1].pos, g), outcode(v[2].pos, g) };
+
+	// Frustum culling: the whole triangle is outside one plane. The guard band planes lie
+	// outside the frustum ones, so this also rejects triangles off screen on one side.
+	if (frustum_culling && (codes[0] & codes[1] & codes[2]))
+		return;
+	int crossed = codes[0] | codes[1] | codes[2];
+	if (!crossed)
+	{
+		bin_triangle(thread, v[0], v[1], v[2]);
+		return;
+	}
+
+	// Sutherland-Hodgman, against only the planes some vertex is outside of. Every plane
+	// adds at most one vertex.
+	clip_vertex polygon[2][3 + clip_plane_count];
+	int count = 3;
+	std::copy(v, v + 3, polygon[0]);
+	int cur = 0;
+	for (int plane = 1; plane <= clip_top && count > 0; plane <<= 1)
+	{
+		if (!(crossed & plane))
+			continue;
+		const clip_vertex* in = polygon[cur];
+		clip_vertex* out = polygon[cur ^ 1];
+		int n = 0;
+		for (int i = 0; i < count; ++i)
+		{
+			const clip_vertex& a = in[i];
+			const clip_vertex& b = in[(i + 1) % count];
+			float da = clip_distance(a.pos, plane, g), db = clip_distance(b.pos, plane, g);
+			if (da >= 0)
+				out[n++] = a;
+			if ((da >= 0) != (db >= 0))
+				out[n++] = lerp(a, b, da / (da - db));
 		}
+		count = n;
+		cur ^= 1;
+	}
+
+	for (int i = 1; i + 1 < count; ++i)
+		bin_triangle(thread, polygon[cur][0], polygon[cur][i], polygon[cur][i + 1]);
+}
+
+void rst::rasterizer::bin_triangle(int thread, const clip_vertex& v0, const clip_vertex& v1, const clip_vertex& v2)
+{
+	std::vector<screen_triangle>& tris = screen_tris[thread];
+	screen_triangle& st = tris.emplace_back();
+	const clip_vertex* v[3] = { &v0, &v1, &v2 };
+	for (int k = 0; k < 3; ++k)
+	{
+		st.tri.setVertex(k, to_screen(v[k]->pos));
+		st.tri.setNormal(k, v[k]->normal);
+		st.tri.setColor(k, v[k]->color[0], v[k]->color[1], v[k]->color[2]);
+		st.tri.setTexCoord(k, v[k]->tex_coords);
+		st.view_pos[k] = v[k]->view_pos;
+	}
+
+	// Triangle setup, then binning into every tile the covered pixels overlap.
+	// Triangles that cover no pixel on screen, or face away, are dropped here.
+	edge_equations& e = st.edges;
+	if (!setup_edges(st.tri, e))
+	{
+		tris.pop_back();
+		return;
+	}
+	st.tex_dx = (e.a[0] * st.tri.tex_coords[0] + e.a[1] * st.tri.tex_coords[1] + e.a[2] * st.tri.tex_coords[2]) * e.inv_area;
+	st.tex_dy = (e.b[0] * st.tri.tex_coords[0] + e.b[1] * st.tri.tex_coords[1] + e.b[2] * st.tri.tex_coords[2]) * e.inv_area;
+
+	int i = tris.size() - 1;
+	int tile_count = tiles_x * tiles_y;
+	for (int ty = e.ymin / tile_size; ty <= e.ymax / tile_size; ++ty)
+		for (int tx = e.xmin / tile_size; tx <= e.xmax / tile_size; ++tx)
+			bins[thread * tile_count + ty * tiles_x + tx].push_back(i);
+}
+
+void rst::rasterizer::setup_triangles(std::vector<Triangle*>& TriangleList)
+{
+	Eigen::Matrix4f mv = view * model;
+	Eigen::Matrix4f mvp = w_sign * projection * mv;
+	Eigen::Matrix4f inv_trans = mv.inverse().transpose();
 
-		Eigen::Matrix4f inv_trans = (view * model).inverse().transpose();
-		Eigen::Vector4f n[] = {
-			inv_trans * to_vec4(t->normal[0], 0.0f),
-			inv_trans * to_vec4(t->normal[1], 0.0f),
-			inv_trans * to_vec4(t->normal[2], 0.0f)
-		};
+	int triangle_count = TriangleList.size();
+	reset_bins();
 
-		//Viewport transformation
-		for (auto& vert : v)
+	// Geometry stage: each thread transforms one contiguous range of triangles and bins
+	// them into its own tile lists, so no locking is needed and draw order is kept
+	run_threads(thread_count, [&](int thread)
+	{
+		int begin = (long long)triangle_count * thread / thread_count;
+		int end = (long long)triangle_count * (thread + 1) / thread_count;
+		for (int i = begin; i < end; ++i)
 		{
-			vert.x() = 0.5 * width * (vert.x() + 1.0);
-			vert.y() = 0.5 * height * (vert.y() + 1.0);
-			vert.z() = vert.z() * f1 + f2;
+			const Triangle* t = TriangleList[i];
+			clip_vertex v[3];
+			for (int k = 0; k < 3; ++k)
+			{
+				//clip space coordinates
+				v[k].pos = mvp * t->v[k];
+				// view space vertice position
+				v[k].view_pos = (mv * t->v[k]).head<3>();
+				//view space normal
+				v[k].normal = (inv_trans * to_vec4(t->normal[k], 0.0f)).head<3>();
+				v[k].color = Eigen::Vector3f(148, 121.0, 92.0);
+				v[k].tex_coords = t->tex_coords[k];
+			}
+			clip_triangle(thread, v);
 		}
+	});
+}
 
-		for (int i = 0; i < 3; ++i)
+void rst::rasterizer::setup_indexed(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer)
+{
+	auto& buf = pos_buf[pos_buffer.pos_id];
+	auto& ind = ind_buf[ind_buffer.ind_id];
+	auto& col = col_buf[col_buffer.col_id];
+	const std::vector<Eigen::Vector3f>* normals = normal_id >= 0 ? &nor_buf[normal_id] : nullptr;
+	const std::vector<Eigen::Vector2f>* texcoords = texcoord_id >= 0 ? &tex_buf[texcoord_id] : nullptr;
+
+	Eigen::Matrix4f mv = view * model;
+	Eigen::Matrix4f mvp = w_sign * projection * mv;
+	Eigen::Matrix4f inv_trans = mv.inverse().transpose();
+
+	// Vertex stage: every vertex is transformed once into the post-transform cache,
+	// however many triangles share it
+	int vertex_count = buf.size();
+	clip_verts.resize(vertex_count);
+	view_verts.resize(vertex_count);
+	view_normals.resize(normals ? vertex_count : 0);
+	run_threads(thread_count, [&](int thread)
+	{
+		int begin = (long long)vertex_count * thread / thread_count;
+		int end = (long long)vertex_count * (thread + 1) / thread_count;
+		for (int i = begin; i < end; ++i)
 		{
-			//screen space coordinates
-			newtri.setVertex(i, v[i]);
+			Eigen::Vector4f p = to_vec4(buf[i], 1.0f);
+			view_verts[i] = (mv * p).head<3>();
+			clip_verts[i] = mvp * p;
+			if (normals)
+				view_normals[i] = (inv_trans * to_vec4((*normals)[i], 0.0f)).head<3>();
 		}
+	});
 
-		for (int i = 0; i < 3; ++i)
+	// Primitive assembly from the cache, then the same clipping, setup and binning as above
+	int triangle_count = ind.size();
+	reset_bins();
+	run_threads(thread_count, [&](int thread)
+	{
+		int begin = (long long)triangle_count * thread / thread_count;
+		int end = (long long)triangle_count * (thread + 1) / thread_count;
+		for (int i = begin; i < end; ++i)
 		{
-			//view space normal
-			newtri.setNormal(i, n[i].head<3>());
+			clip_vertex v[3];
+			for (int k = 0; k < 3; ++k)
+			{
+				int j = ind[i][k];
+				v[k].pos = clip_verts[j];
+				v[k].view_pos = view_verts[j];
+				v[k].normal = normals ? view_normals[j] : Eigen::Vector3f::Zero();
+				v[k].color = col[j];
+				v[k].tex_coords = texcoords ? (*texcoords)[j] : Eigen::Vector2f::Zero();
+			}
+			clip_triangle(thread, v);
 		}
+	});
+}
 
-		newtri.setColor(0, 148, 121.0, 92.0);
-		newtri.setColor(1, 148, 121.0, 92.0);
-		newtri.setColor(2, 148, 121.0, 92.0);
+void rst::rasterizer::draw(std::vector<Triangle*>& TriangleList)
+{
+	draw(TriangleList, fragment_shader);
+}
+
+void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
+{
+	draw(pos_buffer, ind_buffer, col_buffer, type, fragment_shader);
+}
 
-		// Also pass view space vertice position
-		rasterize_triangle(newtri, viewspace_pos);
+int rst::rasterizer::coverage_row(const int64_t w[3], const int64_t a[3])
+{
+#if defined(__SSE2__)
+	// two 64 bit lanes per register, the sign bits of the or-ed edges mark outside pixels
+	__m128i e[3], step[3];
+	for (int k = 0; k < 3; ++k)
+	{
+		e[k] = _mm_set_epi64x(w[k] + a[k], w[k]);
+		step[k] = _mm_set1_epi64x(2 * a[k]);
+	}
+	int outside = 0;
+	for (int i = 0; i < block_size; i += 2)
+	{
+		__m128i any = _mm_or_si128(_mm_or_si128(e[0], e[1]), e[2]);
+		outside |= _mm_movemask_pd(_mm_castsi128_pd(any)) << i;
+		for (int k = 0; k < 3; ++k)
+			e[k] = _mm_add_epi64(e[k], step[k]);
+	}
+	return ~outside & 0xff;
+#else
+	int mask = 0;
+	for (int i = 0; i < block_size; ++i)
+	{
+		if ((w[0] + a[0] * i | w[1] + a[1] * i | w[2] + a[2] * i) >= 0)
+			mask |= 1 << i;
 	}
+	return mask;
+#endif
 }
 
-static Eigen::Vector3f interpolate(float alpha, float beta, float gamma, const Eigen::Vector3f& vert1, const Eigen::Vector3f& vert2, const Eigen::Vector3f& vert3, float weight)
-{
-	return (alpha * vert1 + beta * vert2 + gamma * vert3) / weight;
-}
-
-static Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const Eigen::Vector2f& vert1, const Eigen::Vector2f& vert2, const Eigen::Vector2f& vert3, float weight)
-{
-	auto u = (alpha * vert1[0] + beta * vert2[0] + gamma * vert3[0]);
-	auto v = (alpha * vert1[1] + beta * vert2[1] + gamma * vert3[1]);
-
-	u /= weight;
-	v /= weight;
-
-	return Eigen::Vector2f(u, v);
-}
-
-//Screen space rasterization
-void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos)
-{
-	// TODO: From your HW2, get the triangle rasterization code.
-
-	// 寻找上下左右边界，创建boundingbox
-	auto v = t.toVector4();
-	float xMax = v[0].x(), xMin = v[0].x();
-	if (xMax < v[1].x()) { xMax = v[1].x(); }
-	if (xMax < v[2].x()) { xMax = v[2].x(); }
-	if (xMin > v[1].x()) { xMin = v[1].x(); }
-	if (xMin > v[2].x()) { xMin = v[2].x(); }
-	float yMax = v[0].y(), yMin = v[0].y();
-	if (yMax < v[1].y()) { yMax = v[1].y(); }
-	if (yMax < v[2].y()) { yMax = v[2].y(); }
-	if (yMin > v[1].y()) { yMin = v[1].y(); }
-	if (yMin > v[2].y()) { yMin = v[2].y(); }
-
-	// 遍历boundingbox中的点
-	for (int x = xMin; x <= xMax; ++x) {
-		for (int y = yMin; y <= yMax; ++y) {
-			// TODO: Inside your rasterization loop:
-			//    * v[i].w() is the vertex view space depth value z.
-			//    * Z is interpolated view space depth for the current pixel
-			//    * zp is depth between zNear and zFar, used for z-buffer
-
-			// float Z = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-			// float zp = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-			// zp *= Z;
-			if (insideTriangle(x, y, v.data())) {
-				// 深度插值
-				auto [alpha, beta, gamma] = computeBarycentric2D(x, y, t.v);
-				float Z = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-				float zp = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-				zp *= Z;
-				// 比较深度
-				int index = get_index(x, y);
-				if (depth_buf[index] > zp) {
-					depth_buf[index] = zp;
-
-					// TODO: Interpolate the attributes:
-					// auto interpolated_color
-					// auto interpolated_normal
-					// auto interpolated_texcoords
-					// auto interpolated_shadingcoords
-
-					// Use: fragment_shader_payload payload( interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
-					// Use: payload.view_pos = interpolated_shadingcoords;
-					// Use: Instead of passing the triangle's color directly to the frame buffer, pass the color to the shaders first to get the final color;
-					// Use: auto pixel_color = fragment_shader(payload);
-
-					auto interpolated_color = interpolate(alpha, beta, gamma, t.color[0], t.color[1], t.color[2], 1);
-					auto interpolated_normal = interpolate(alpha, beta, gamma, t.normal[0], t.normal[1], t.normal[2], 1);
-					auto interpolated_texcoords = interpolate(alpha, beta, gamma, t.tex_coords[0], t.tex_coords[1], t.tex_coords[2], 1);
-					auto interpolated_shadingcoords = interpolate(alpha, beta, gamma, view_pos[0], view_pos[1], view_pos[2], 1);
-
-					fragment_shader_payload payload(interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
-					payload.view_pos = interpolated_shadingcoords;
-					auto pixel_color = fragment_shader(payload);
-					set_pixel({ x, y }, pixel_color);
-				}
-			}
+void rst::rasterizer::update_hiz(int bx, int by)
+{
+	float zmax = -std::numeric_limits<float>::infinity();
+	int rows = std::min(block_size, height - by), columns = std::min(block_size, width - bx);
+#if defined(__SSE2__)
+	if (columns == block_size)
+	{
+		__m128 m = _mm_set1_ps(zmax);
+		for (int y = by; y < by + rows; ++y)
+		{
+			const float* depth = &depth_buf[get_index(bx, y)];
+			m = _mm_max_ps(m, _mm_max_ps(_mm_loadu_ps(depth), _mm_loadu_ps(depth + 4)));
 		}
+		m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+		m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+		zmax = _mm_cvtss_f32(m);
+	}
+	else
+#endif
+	for (int y = by; y < by + rows; ++y)
+	{
+		const float* depth = &depth_buf[get_index(bx, y)];
+		for (int i = 0; i < columns; ++i)
+			zmax = std::max(zmax, depth[i]);
 	}
 
+	float& block = block_zmax[by / block_size * blocks_x + bx / block_size];
+	float& tile = tile_zmax[by / tile_size * tiles_x + bx / tile_size];
+	bool was_tile_max = block >= tile;
+	block = zmax;
+
+	// Depths only come down, so the tile maximum changes only if this block was holding it
+	if (!was_tile_max)
+		return;
+	int tx = bx / tile_size * (tile_size / block_size), ty = by / tile_size * (tile_size / block_size);
+	tile = -std::numeric_limits<float>::infinity();
+	for (int j = ty; j < std::min(ty + tile_size / block_size, blocks_y); ++j)
+		for (int i = tx; i < std::min(tx + tile_size / block_size, blocks_x); ++i)
+			tile = std::max(tile, block_zmax[j * blocks_x + i]);
 }
 
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
@@ -339,6 +571,8 @@ void rst::rasterizer::set_view(const Eigen::Matrix4f& v)
 void rst::rasterizer::set_projection(const Eigen::Matrix4f& p)
 {
 	projection = p;
+	// w of a point straight ahead of the camera
+	w_sign = p(3, 3) - p(3, 2) < 0 ? -1.0f : 1.0f;
 }
 
 void rst::rasterizer::clear(rst::Buffers buff)
@@ -350,6 +584,8 @@ void rst::rasterizer::clear(rst::Buffers buff)
 	if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
 	{
 		std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+		std::fill(block_zmax.begin(), block_zmax.end(), std::numeric_limits<float>::infinity());
+		std::fill(tile_zmax.begin(), tile_zmax.end(), std::numeric_limits<float>::infinity());
 	}
 }
 
@@ -359,17 +595,60 @@ rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
 	depth_buf.resize(w * h);
 
 	texture = std::nullopt;
+
+	tiles_x = (w + tile_size - 1) / tile_size;
+	tiles_y = (h + tile_size - 1) / tile_size;
+	set_thread_count(0);
+
+	blocks_x = (w + block_size - 1) / block_size;
+	blocks_y = (h + block_size - 1) / block_size;
+	block_zmax.resize(blocks_x * blocks_y);
+	tile_zmax.resize(tiles_x * tiles_y);
+}
+
+void rst::rasterizer::set_thread_count(int n)
+{
+	thread_count = n > 0 ? n : std::max(1u, std::thread::hardware_concurrency());
+}
+
+void rst::rasterizer::set_culling(Culling mode)
+{
+	culling = mode;
+}
+
+void rst::rasterizer::set_frustum_culling(bool enable)
+{
+	frustum_culling = enable;
+}
+
+void rst::rasterizer::set_shading(Shading mode)
+{
+	shading = mode;
+	prim_buf.resize(mode != Shading::Forward ? width * height : 0);
+	gbuf.resize(mode == Shading::Deferred ? width * height : 0);
 }
 
-int rst::rasterizer::get_index(int x, int y)
+void rst::rasterizer::g_buffer::resize(int n)
 {
-	return (height - y) * width + x;
+	for (auto& c : color)
+		c.resize(n);
+	for (auto& c : normal)
+		c.resize(n);
+	for (auto& c : tex_coords)
+		c.resize(n);
+	for (int c = 0; c < 2; ++c)
+	{
+		tex_dx[c].resize(n);
+		tex_dy[c].resize(n);
+	}
+	for (auto& c : view_pos)
+		c.resize(n);
 }
 
 void rst::rasterizer::set_pixel(const Vector2i& point, const Eigen::Vector3f& color)
 {
 	//old index: auto ind = point.y() + point.x() * width;
-	int ind = (height - point.y()) * width + point.x();
+	int ind = (height - 1 - point.y()) * width + point.x();
 	frame_buf[ind] = color;
 }
 
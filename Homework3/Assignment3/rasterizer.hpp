@@ -10,7 +10,15 @@
 
 #include <optional>
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <stdexcept>
 #include <eigen3/Eigen/Eigen>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 using namespace Eigen;
 
 namespace rst
@@ -37,6 +45,38 @@ namespace rst
 		Triangle
 	};
 
+	/*
+	 * When draw() runs the fragment shader:
+	 *   Forward:      for every fragment that passes the depth test at the time it is drawn
+	 *   DepthPrepass: once per covered pixel, after a depth-only pass found the visible triangle
+	 *   Deferred:     once per covered pixel, from the attributes the nearest fragment left in a G-buffer
+	 * */
+	enum class Shading
+	{
+		Forward,
+		DepthPrepass,
+		Deferred
+	};
+
+	// Faces that draw() skips. Counter-clockwise triangles on screen face the camera.
+	enum class Culling
+	{
+		None,
+		Back,
+		Front
+	};
+
+	// A vertex on its way through clipping: clip space position and the attributes that
+	// are interpolated along with it
+	struct clip_vertex
+	{
+		Eigen::Vector4f pos;
+		Eigen::Vector3f view_pos;
+		Eigen::Vector3f normal;
+		Eigen::Vector3f color; // 0 to 255, as given to Triangle::setColor
+		Eigen::Vector2f tex_coords;
+	};
+
 	/*
 	 * For the curious : The draw function takes two buffer id's as its arguments. These two structs
 	 * make sure that if you mix up with their orders, the compiler won't compile it.
@@ -57,6 +97,11 @@ namespace rst
 		int col_id = 0;
 	};
 
+	struct tex_buf_id
+	{
+		int tex_id = 0;
+	};
+
 	class rasterizer
 	{
 	public:
@@ -65,6 +110,7 @@ namespace rst
 		ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
 		col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
 		col_buf_id load_normals(const std::vector<Eigen::Vector3f>& normals);
+		tex_buf_id load_texcoords(const std::vector<Eigen::Vector2f>& texcoords);
 
 		void set_model(const Eigen::Matrix4f& m);
 		void set_view(const Eigen::Matrix4f& v);
@@ -73,21 +119,98 @@ namespace rst
 		void set_texture(Texture tex) { texture = tex; }
 
 		void set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader);
+		// The fragment shader is called from several threads at once, it must not modify shared state
 		void set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader);
 
+		// Number of threads draw() uses for both pipeline stages, 0 means one per hardware core
+		void set_thread_count(int n);
+
+		void set_shading(Shading mode);
+
+		void set_culling(Culling mode);
+		// Drop triangles entirely outside the view frustum before triangle setup, on by default
+		void set_frustum_culling(bool enable);
+
 		void set_pixel(const Vector2i& point, const Eigen::Vector3f& color);
 
 		void clear(Buffers buff);
 
+		// Indexed draw: the triangles index the loaded positions and colors, plus the normals
+		// and texture coordinates of the last load_normals and load_texcoords
 		void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
 		void draw(std::vector<Triangle*>& TriangleList);
+		// Same as the draws above, but calls shader directly instead of the std::function
+		// set by set_fragment_shader, so the compiler can inline it into the raster loops
+		template <typename FragmentShader>
+		void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type, const FragmentShader& shader);
+		template <typename FragmentShader>
+		void draw(std::vector<Triangle*>& TriangleList, const FragmentShader& shader);
 
 		std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
 
 	private:
 		void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
 
-		void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos);
+		struct screen_triangle;
+		struct edge_equations;
+		// Run fn(0) .. fn(count - 1) on count threads, the calling thread takes fn(0)
+		static void run_threads(int count, const std::function<void(int)>& fn);
+		// Homogeneous division and viewport transformation of a clip space vertex
+		Eigen::Vector4f to_screen(Eigen::Vector4f v) const;
+		// Geometry stage of draw(): transform, set up and bin all triangles
+		void setup_triangles(std::vector<Triangle*>& TriangleList);
+		void setup_indexed(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer);
+		void reset_bins();
+		// Cull and clip the triangle, then bin what is left of it
+		void clip_triangle(int thread, const clip_vertex* v);
+		// Set up a clipped triangle for rasterization and add it to the bins of geometry thread thread
+		void bin_triangle(int thread, const clip_vertex& v0, const clip_vertex& v1, const clip_vertex& v2);
+		// Raster stage of draw()
+		template <typename FragmentShader>
+		void raster_tiles(const FragmentShader& shader);
+		// Triangle setup for rasterize_triangle, false if t covers no pixel
+		bool setup_edges(const Triangle& t, edge_equations& e) const;
+		// What rasterize_triangle does with the covered pixels: depth test and shade them,
+		// depth test and only record the triangle id (depth pre-pass), shade the pixels
+		// whose recorded id is the triangle's (shading pass after the pre-pass), or depth
+		// test and write the attributes to the G-buffer
+		enum class raster_pass
+		{
+			shade,
+			depth,
+			shade_visible,
+			gbuffer
+		};
+		// Rasterize the part of triangle id inside the tile [x0, x1) x [y0, y1)
+		template <typename FragmentShader>
+		void rasterize_triangle(const screen_triangle& st, int id, int x0, int y0, int x1, int y1, raster_pass pass, const FragmentShader& shader);
+		// Coverage of the block row starting where the edge functions are w, bit i is set
+		// if pixel x + i is inside all three edges
+		static int coverage_row(const int64_t w[3], const int64_t a[3]);
+		// Rasterize the pixels of row y in mask, bit i is pixel x + i. True if any depth was written.
+		template <typename FragmentShader>
+		bool shade_row(const screen_triangle& st, int id, int x, int y, int mask, const int64_t w[3], raster_pass pass, const FragmentShader& shader);
+		// Run the fragment shader on the G-buffer pixels of the tile [x0, x1) x [y0, y1)
+		template <typename FragmentShader>
+		void shade_gbuffer(int x0, int y0, int x1, int y1, const FragmentShader& shader);
+
+		static Eigen::Vector3f interpolate(float alpha, float beta, float gamma, const Eigen::Vector3f& vert1, const Eigen::Vector3f& vert2, const Eigen::Vector3f& vert3, float weight)
+		{
+			return (alpha * vert1 + beta * vert2 + gamma * vert3) / weight;
+		}
+
+		static Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const Eigen::Vector2f& vert1, const Eigen::Vector2f& vert2, const Eigen::Vector2f& vert3, float weight)
+		{
+			auto u = (alpha * vert1[0] + beta * vert2[0] + gamma * vert3[0]);
+			auto v = (alpha * vert1[1] + beta * vert2[1] + gamma * vert3[1]);
+
+			u /= weight;
+			v /= weight;
+
+			return Eigen::Vector2f(u, v);
+		}
+		// Recompute the hierarchical z of block (bx, by) and its tile from depth_buf
+		void update_hiz(int bx, int by);
 
 		// VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
@@ -95,13 +218,25 @@ namespace rst
 		Eigen::Matrix4f model;
 		Eigen::Matrix4f view;
 		Eigen::Matrix4f projection;
+		// Clip space positions are multiplied by this, so that w is positive in front of the
+		// camera whichever way the projection matrix points its w. Negating x, y, z and w
+		// together does not change the point.
+		float w_sign = 1.0f;
 
 		int normal_id = -1;
+		int texcoord_id = -1;
 
 		std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
 		std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
 		std::map<int, std::vector<Eigen::Vector3f>> col_buf;
 		std::map<int, std::vector<Eigen::Vector3f>> nor_buf;
+		std::map<int, std::vector<Eigen::Vector2f>> tex_buf;
+
+		// Post-transform cache of the indexed draw: clip space position, view space position
+		// and view space normal of every vertex
+		std::vector<Eigen::Vector4f> clip_verts;
+		std::vector<Eigen::Vector3f> view_verts;
+		std::vector<Eigen::Vector3f> view_normals;
 
 		std::optional<Texture> texture;
 
@@ -110,11 +245,312 @@ namespace rst
 
 		std::vector<Eigen::Vector3f> frame_buf;
 		std::vector<float> depth_buf;
-		int get_index(int x, int y);
+		int get_index(int x, int y) const { return (height - 1 - y) * width + x; }
 
 		int width, height;
 
+		// Edge functions E_k(x, y) = a[k] * x + b[k] * y + c[k] of a screen triangle at pixel (x, y),
+		// from vertices snapped to 1/256 pixel. Edge k lies opposite vertex k and is >= 0 exactly
+		// on the pixels the top-left fill rule gives to the triangle.
+		struct edge_equations
+		{
+			int64_t a[3], b[3], c[3];
+			float inv_area; // E_k * inv_area is the barycentric coordinate of vertex k
+			float dzdx, dzdy; // change of the screen space depth from one pixel to the next
+			float zmin;       // nearest vertex depth
+			int xmin, ymin, xmax, ymax; // covered pixels, clamped to the screen
+		};
+		// Binned pipeline: draw() first transforms all triangles and sorts them into the
+		// screen tiles their bounding boxes touch, then rasterizes whole tiles per thread
+		struct screen_triangle
+		{
+			Triangle tri; // screen space vertices, view space normals
+			std::array<Eigen::Vector3f, 3> view_pos;
+			edge_equations edges;
+			// Attributes are interpolated linearly on screen, so the texture coordinates change
+			// by the same amount from one pixel to the next everywhere in the triangle
+			Eigen::Vector2f tex_dx, tex_dy;
+		};
+		static constexpr int tile_size = 64;
+		// Tiles are walked in blocks of 8x8 pixels
+		static constexpr int block_size = 8;
+		// Depth bounds for the hierarchical z test are lowered by this much, to stay below the
+		// depth of every pixel despite the rounding in their interpolation
+		static constexpr float hiz_slack = 1e-4f;
+		int tiles_x, tiles_y;
+		int thread_count;
+		// Triangles ready for rasterization, per geometry thread. Clipping can turn one
+		// triangle into several, so each thread appends to its own list.
+		std::vector<std::vector<screen_triangle>> screen_tris;
+		// id of the first triangle of every geometry thread, for prim_buf
+		std::vector<int> first_id;
+		Shading shading = Shading::Forward;
+		Culling culling = Culling::None;
+		bool frustum_culling = true;
+		// id of the visible triangle per pixel during a draw, -1 where nothing was drawn.
+		// Only used with the depth pre-pass and deferred shading.
+		std::vector<int> prim_buf;
+		// Interpolated attributes of the nearest fragment per pixel, one array per component
+		struct g_buffer
+		{
+			std::vector<float> color[3];
+			std::vector<float> normal[3];
+			std::vector<float> tex_coords[2];
+			std::vector<float> tex_dx[2], tex_dy[2];
+			std::vector<float> view_pos[3];
+
+			void resize(int n);
+		};
+		g_buffer gbuf;
+
+		// Hierarchical z: the farthest depth of every 8x8 block and of every tile. A triangle
+		// whose depth over a block or tile is not below it cannot pass the depth test there.
+		int blocks_x, blocks_y;
+		std::vector<float> block_zmax;
+		std::vector<float> tile_zmax;
+
+		// bins[t * tiles_x * tiles_y + tile]: triangles geometry thread t put into tile, in draw
+		// order, as indices into screen_tris[t]
+		std::vector<std::vector<int>> bins;
+
 		int next_id = 0;
 		int get_next_id() { return next_id++; }
 	};
 }
+
+// The raster stage is templated on the fragment shader, so it lives in the header
+
+template <typename FragmentShader>
+void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type, const FragmentShader& shader)
+{
+	if (type != rst::Primitive::Triangle)
+	{
+		throw std::runtime_error("Drawing primitives other than triangle is not implemented yet!");
+	}
+	setup_indexed(pos_buffer, ind_buffer, col_buffer);
+	raster_tiles(shader);
+}
+
+template <typename FragmentShader>
+void rst::rasterizer::draw(std::vector<Triangle*>& TriangleList, const FragmentShader& shader)
+{
+	setup_triangles(TriangleList);
+	raster_tiles(shader);
+}
+
+template <typename FragmentShader>
+void rst::rasterizer::raster_tiles(const FragmentShader& shader)
+{
+	// Raster stage: threads take whole tiles and own their pixels in the color and
+	// depth buffers. The bins of the geometry threads are walked in thread order, so
+	// every tile sees its triangles in draw order just like the serial loop.
+	int tile_count = tiles_x * tiles_y;
+	first_id.resize(thread_count);
+	for (int thread = 0, id = 0; thread < thread_count; ++thread)
+	{
+		first_id[thread] = id;
+		id += screen_tris[thread].size();
+	}
+
+	std::atomic<int> next_tile(0);
+	run_threads(thread_count, [&](int)
+	{
+		for (int tile = next_tile++; tile < tile_count; tile = next_tile++)
+		{
+			int x0 = tile % tiles_x * tile_size, y0 = tile / tiles_x * tile_size;
+			int x1 = std::min(x0 + tile_size, width), y1 = std::min(y0 + tile_size, height);
+			auto raster_tile = [&](raster_pass pass)
+			{
+				for (int thread = 0; thread < thread_count; ++thread)
+					for (int i : bins[thread * tile_count + tile])
+						rasterize_triangle(screen_tris[thread][i], first_id[thread] + i, x0, y0, x1, y1, pass, shader);
+			};
+			if (shading == Shading::Forward)
+			{
+				raster_tile(raster_pass::shade);
+				continue;
+			}
+
+			for (int y = y0; y < y1; ++y)
+				std::fill_n(&prim_buf[get_index(x0, y)], x1 - x0, -1);
+			if (shading == Shading::DepthPrepass)
+			{
+				raster_tile(raster_pass::depth);
+				raster_tile(raster_pass::shade_visible);
+			}
+			else
+			{
+				// the tile's pixels are shaded as soon as all its triangles are in the G-buffer
+				raster_tile(raster_pass::gbuffer);
+				shade_gbuffer(x0, y0, x1, y1, shader);
+			}
+		}
+	});
+}
+
+//Screen space rasterization
+template <typename FragmentShader>
+void rst::rasterizer::rasterize_triangle(const screen_triangle& st, int id, int x0, int y0, int x1, int y1, raster_pass pass, const FragmentShader& shader)
+{
+	const Triangle& t = st.tri;
+	const edge_equations& e = st.edges;
+
+	// 裁剪到当前tile
+	int xBegin = std::max(x0, e.xmin), xEnd = std::min(x1 - 1, e.xmax);
+	int yBegin = std::max(y0, e.ymin), yEnd = std::min(y1 - 1, e.ymax);
+	if (xBegin > xEnd || yBegin > yEnd)
+		return;
+
+	// 整个三角形都在tile里已有的深度之后
+	float zmin = e.zmin - hiz_slack;
+	if (zmin >= tile_zmax[y0 / tile_size * tiles_x + x0 / tile_size])
+		return;
+
+	// 按8x8的像素块遍历，块和tile对齐。整块都在某条边外的直接跳过，
+	// 整块都在三角形内的不用再测试覆盖
+	for (int by = yBegin - yBegin % block_size; by <= yEnd; by += block_size) {
+		for (int bx = xBegin - xBegin % block_size; bx <= xEnd; bx += block_size) {
+			int64_t w[3];
+			bool outside = false, covered = true;
+			for (int k = 0; k < 3; ++k) {
+				w[k] = e.a[k] * bx + e.b[k] * by + e.c[k];
+				// largest and smallest value of the edge function over the block
+				int64_t hi = w[k] + (block_size - 1) * (std::max<int64_t>(e.a[k], 0) + std::max<int64_t>(e.b[k], 0));
+				int64_t lo = w[k] + (block_size - 1) * (std::min<int64_t>(e.a[k], 0) + std::min<int64_t>(e.b[k], 0));
+				outside |= hi < 0;
+				covered &= lo >= 0;
+			}
+			if (outside)
+				continue;
+
+			// The nearest the triangle gets within the block is behind everything drawn there
+			double zorigin = (w[0] * (double)t.v[0].z() + w[1] * (double)t.v[1].z() + w[2] * (double)t.v[2].z()) * e.inv_area;
+			float zblock = zorigin + (block_size - 1) * (std::min(e.dzdx, 0.0f) + std::min(e.dzdy, 0.0f)) - hiz_slack;
+			if (std::max(zmin, zblock) >= block_zmax[by / block_size * blocks_x + bx / block_size])
+				continue;
+
+			// pixels of the block inside the clipped bounding box
+			int columns = 0;
+			for (int i = 0; i < block_size; ++i)
+				if (bx + i >= xBegin && bx + i <= xEnd)
+					columns |= 1 << i;
+
+			// The edge functions are stepped with one add per row
+			bool written = false;
+			for (int y = by; y < by + block_size; ++y) {
+				if (y >= yBegin && y <= yEnd) {
+					int mask = columns & (covered ? 0xff : coverage_row(w, e.a));
+					if (mask)
+						written |= shade_row(st, id, bx, y, mask, w, pass, shader);
+				}
+				for (int k = 0; k < 3; ++k)
+					w[k] += e.b[k];
+			}
+			if (written)
+				update_hiz(bx, by);
+		}
+	}
+}
+
+template <typename FragmentShader>
+bool rst::rasterizer::shade_row(const screen_triangle& st, int id, int x, int y, int mask, const int64_t w[3], raster_pass pass, const FragmentShader& shader)
+{
+	const Triangle& t = st.tri;
+	const edge_equations& e = st.edges;
+
+	// 深度插值, screen space z is affine in x and y
+	float z = (w[0] * (double)t.v[0].z() + w[1] * (double)t.v[1].z() + w[2] * (double)t.v[2].z()) * e.inv_area;
+	int index = get_index(x, y);
+
+	// 比较深度, all 8 pixels at once if the row does not run past the buffer
+	bool written = false;
+#if defined(__SSE2__)
+	if (pass != raster_pass::shade_visible && x + block_size <= width)
+	{
+		__m128 z0 = _mm_add_ps(_mm_set1_ps(z), _mm_mul_ps(_mm_setr_ps(0, 1, 2, 3), _mm_set1_ps(e.dzdx)));
+		__m128 z1 = _mm_add_ps(z0, _mm_set1_ps(4 * e.dzdx));
+		int closer = _mm_movemask_ps(_mm_cmplt_ps(z0, _mm_loadu_ps(&depth_buf[index])))
+			| _mm_movemask_ps(_mm_cmplt_ps(z1, _mm_loadu_ps(&depth_buf[index + 4]))) << 4;
+		mask &= closer;
+	}
+#endif
+
+	for (; mask; mask &= mask - 1)
+	{
+		int i = 0;
+		while (!(mask >> i & 1))
+			++i;
+		if (pass == raster_pass::shade_visible)
+		{
+			if (prim_buf[index + i] != id)
+				continue;
+		}
+		else
+		{
+			float zp = z + i * e.dzdx;
+			if (!(depth_buf[index + i] > zp))
+				continue;
+			depth_buf[index + i] = zp;
+			written = true;
+			if (pass != raster_pass::shade)
+				prim_buf[index + i] = id;
+			if (pass == raster_pass::depth)
+				continue;
+		}
+
+		float alpha = (w[0] + e.a[0] * i) * e.inv_area;
+		float beta = (w[1] + e.a[1] * i) * e.inv_area;
+		float gamma = (w[2] + e.a[2] * i) * e.inv_area;
+		auto interpolated_color = interpolate(alpha, beta, gamma, t.color[0], t.color[1], t.color[2], 1);
+		auto interpolated_normal = interpolate(alpha, beta, gamma, t.normal[0], t.normal[1], t.normal[2], 1);
+		auto interpolated_texcoords = interpolate(alpha, beta, gamma, t.tex_coords[0], t.tex_coords[1], t.tex_coords[2], 1);
+		auto interpolated_shadingcoords = interpolate(alpha, beta, gamma, st.view_pos[0], st.view_pos[1], st.view_pos[2], 1);
+
+		if (pass == raster_pass::gbuffer)
+		{
+			int ind = index + i;
+			for (int c = 0; c < 3; ++c)
+			{
+				gbuf.color[c][ind] = interpolated_color[c];
+				gbuf.normal[c][ind] = interpolated_normal[c];
+				gbuf.view_pos[c][ind] = interpolated_shadingcoords[c];
+			}
+			for (int c = 0; c < 2; ++c)
+			{
+				gbuf.tex_coords[c][ind] = interpolated_texcoords[c];
+				gbuf.tex_dx[c][ind] = st.tex_dx[c];
+				gbuf.tex_dy[c][ind] = st.tex_dy[c];
+			}
+			continue;
+		}
+
+		fragment_shader_payload payload(interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
+		payload.view_pos = interpolated_shadingcoords;
+		payload.tex_dx = st.tex_dx;
+		payload.tex_dy = st.tex_dy;
+		frame_buf[index + i] = shader(payload);
+	}
+	return written;
+}
+
+template <typename FragmentShader>
+void rst::rasterizer::shade_gbuffer(int x0, int y0, int x1, int y1, const FragmentShader& shader)
+{
+	for (int y = y0; y < y1; ++y)
+	{
+		for (int ind = get_index(x0, y), end = ind + x1 - x0; ind < end; ++ind)
+		{
+			if (prim_buf[ind] < 0)
+				continue;
+			Eigen::Vector3f color(gbuf.color[0][ind], gbuf.color[1][ind], gbuf.color[2][ind]);
+			Eigen::Vector3f normal(gbuf.normal[0][ind], gbuf.normal[1][ind], gbuf.normal[2][ind]);
+			Eigen::Vector2f tex_coords(gbuf.tex_coords[0][ind], gbuf.tex_coords[1][ind]);
+
+			fragment_shader_payload payload(color, normal.normalized(), tex_coords, texture ? &*texture : nullptr);
+			payload.view_pos = Eigen::Vector3f(gbuf.view_pos[0][ind], gbuf.view_pos[1][ind], gbuf.view_pos[2][ind]);
+			payload.tex_dx = Eigen::Vector2f(gbuf.tex_dx[0][ind], gbuf.tex_dx[1][ind]);
+			payload.tex_dy = Eigen::Vector2f(gbuf.tex_dy[0][ind], gbuf.tex_dy[1][ind]);
+			frame_buf[ind] = shader(payload);
+		}
+	}
+}
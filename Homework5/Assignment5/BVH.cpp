@@ -0,0 +1,268 @@
+#include "BVH.hpp"
+
+#include <algorithm>
+#include <future>
+#include <thread>
+
+// Bounds and centroid of one primitive, computed once before the build so the
+// split code never calls back into the (virtual) objects
+struct BVHPrimitiveInfo
+{
+	BVHPrimitiveInfo() {}
+	BVHPrimitiveInfo(size_t primitiveNumber, const Bounds3& bounds)
+		: primitiveNumber(primitiveNumber), bounds(bounds), centroid(0.5f * bounds.pMin + 0.5f * bounds.pMax)
+	{
+	}
+	size_t primitiveNumber;
+	Bounds3 bounds;
+	Vector3f centroid;
+};
+
+// One bin of the SAH sweep
+struct Bucket
+{
+	int count = 0;
+	Bounds3 bounds;
+};
+
+static constexpr int nBuckets = 16;
+// subtrees smaller than this are not worth a task of their own
+static constexpr int parallelBuildThreshold = 4096;
+
+BVHAccel::BVHAccel(std::vector<BVHPrimitive> p, int maxPrimsInNode, SplitMethod splitMethod, float traversalCost)
+	: maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod), traversalCost(traversalCost), primitives(std::move(p))
+{
+	if (primitives.empty())
+		return;
+
+	std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
+	for (size_t i = 0; i < primitives.size(); ++i)
+		primitiveInfo[i] = BVHPrimitiveInfo(i, primitives[i].object->getBounds(primitives[i].index));
+
+	// Build subtrees concurrently for the first few levels, one level per doubling of cores
+	int parallelDepth = 0;
+	for (unsigned int n = std::thread::hardware_concurrency(); n > 1; n >>= 1)
+		++parallelDepth;
+	BVHBuildNode* root = recursiveBuild(primitiveInfo, 0, primitives.size(), parallelDepth);
+
+	// The build only permutes primitiveInfo, leaves reference ranges of it
+	std::vector<BVHPrimitive> orderedPrims(primitives.size());
+	for (size_t i = 0; i < primitiveInfo.size(); ++i)
+		orderedPrims[i] = primitives[primitiveInfo[i].primitiveNumber];
+	primitives.swap(orderedPrims);
+
+	// Flatten the tree into a depth-first array, the linked build nodes are no longer needed afterwards
+	nodes.reserve(2 * primitives.size());
+	flattenBVHTree(root);
+	deleteBVHTree(root);
+}
+
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int parallelDepth)
+{
+	BVHBuildNode* node = new BVHBuildNode();
+
+	// Compute bounds of all primitives in BVH node
+	Bounds3 bounds;
+	for (int i = start; i < end; ++i)
+		bounds = Union(bounds, primitiveInfo[i].bounds);
+	int nPrimitives = end - start;
+	if (nPrimitives == 1)
+	{
+		// Create leaf _BVHBuildNode_
+		node->initLeaf(start, nPrimitives, bounds);
+		return node;
+	}
+
+	Bounds3 centroidBounds;
+	for (int i = start; i < end; ++i)
+		centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+	int dim = centroidBounds.maxExtent();
+	const Vector3f centroidExtent = centroidBounds.Diagonal();
+
+	// Partition primitives into two sets and build children
+	int mid = (start + end) / 2;
+	if ((splitMethod == SplitMethod::NAIVE || centroidExtent[dim] == 0) && nPrimitives <= maxPrimsInNode)
+	{
+		node->initLeaf(start, nPrimitives, bounds);
+		return node;
+	}
+	if (centroidExtent[dim] == 0)
+	{
+		// All centroids coincide, no split plane separates them: just halve the range
+	}
+	else if (splitMethod == SplitMethod::NAIVE || nPrimitives <= 2)
+	{
+		// Partition primitives into equally-sized subsets
+		std::nth_element(&primitiveInfo[start], &primitiveInfo[mid], &primitiveInfo[end - 1] + 1,
+			[dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b)
+			{
+				return a.centroid[dim] < b.centroid[dim];
+			});
+	}
+	else
+	{
+		// Partition primitives using approximate SAH
+		Bucket buckets[nBuckets];
+		auto bucketOf = [&](const BVHPrimitiveInfo& pi)
+		{
+			const Vector3f offset = centroidBounds.Offset(pi.centroid);
+			return std::min(nBuckets - 1, (int)(nBuckets * offset[dim]));
+		};
+		for (int i = start; i < end; ++i)
+		{
+			int b = bucketOf(primitiveInfo[i]);
+			buckets[b].count++;
+			buckets[b].bounds = Union(buckets[b].bounds, primitiveInfo[i].bounds);
+		}
+
+		// Sweep the buckets from both sides to get the cost of splitting after each one
+		float cost[nBuckets - 1];
+		Bounds3 b0;
+		int count0 = 0;
+		for (int i = 0; i < nBuckets - 1; ++i)
+		{
+			b0 = Union(b0, buckets[i].bounds);
+			count0 += buckets[i].count;
+			cost[i] = count0 > 0 ? count0 * b0.SurfaceArea() : 0;
+		}
+		Bounds3 b1;
+		int count1 = 0;
+		for (int i = nBuckets - 1; i > 0; --i)
+		{
+			b1 = Union(b1, buckets[i].bounds);
+			count1 += buckets[i].count;
+			cost[i - 1] += count1 > 0 ? count1 * b1.SurfaceArea() : 0;
+		}
+
+		int minCostSplitBucket = 0;
+		for (int i = 1; i < nBuckets - 1; ++i)
+		{
+			if (cost[i] < cost[minCostSplitBucket])
+				minCostSplitBucket = i;
+		}
+		float minCost = traversalCost + cost[minCostSplitBucket] / bounds.SurfaceArea();
+
+		// Either create leaf or split primitives at selected SAH bucket. Leaves never hold
+		// more than maxPrimsInNode primitives, larger ranges are split even when no split pays off.
+		float leafCost = nPrimitives;
+		if (nPrimitives <= maxPrimsInNode && minCost >= leafCost)
+		{
+			node->initLeaf(start, nPrimitives, bounds);
+			return node;
+		}
+		BVHPrimitiveInfo* pmid = std::partition(&primitiveInfo[start], &primitiveInfo[end - 1] + 1,
+			[&](const BVHPrimitiveInfo& pi)
+			{
+				return bucketOf(pi) <= minCostSplitBucket;
+			});
+		mid = pmid - &primitiveInfo[0];
+	}
+
+	BVHBuildNode* left;
+	BVHBuildNode* right;
+	if (parallelDepth > 0 && nPrimitives >= parallelBuildThreshold)
+	{
+		auto leftTask = std::async(std::launch::async, [&]()
+			{
+				return recursiveBuild(primitiveInfo, start, mid, parallelDepth - 1);
+			});
+		right = recursiveBuild(primitiveInfo, mid, end, parallelDepth - 1);
+		left = leftTask.get();
+	}
+	else
+	{
+		left = recursiveBuild(primitiveInfo, start, mid, 0);
+		right = recursiveBuild(primitiveInfo, mid, end, 0);
+	}
+	node->initInterior(dim, left, right);
+
+	return node;
+}
+
+int BVHAccel::flattenBVHTree(BVHBuildNode* node)
+{
+	int myOffset = nodes.size();
+	nodes.emplace_back();
+	nodes[myOffset].bounds = node->bounds;
+	if (node->nPrimitives > 0)
+	{
+		nodes[myOffset].primitivesOffset = node->firstPrimOffset;
+		nodes[myOffset].nPrimitives = node->nPrimitives;
+	}
+	else
+	{
+		// Create interior flattened BVH node
+		nodes[myOffset].axis = node->splitAxis;
+		nodes[myOffset].nPrimitives = 0;
+		flattenBVHTree(node->left);
+		int secondChildOffset = flattenBVHTree(node->right);
+		nodes[myOffset].secondChildOffset = secondChildOffset;
+	}
+	return myOffset;
+}
+
+void BVHAccel::deleteBVHTree(BVHBuildNode* node)
+{
+	if (!node)
+		return;
+	deleteBVHTree(node->left);
+	deleteBVHTree(node->right);
+	delete node;
+}
+
+bool BVHAccel::Intersect(const Vector3f& orig, const Vector3f& dir, float& tNear, Object*& hitObject, uint32_t& index, Vector2f& uv) const
+{
+	if (nodes.empty())
+		return false;
+
+	Vector3f invDir(1 / dir.x, 1 / dir.y, 1 / dir.z);
+	std::array<int, 3> dirIsNeg = { dir.x < 0, dir.y < 0, dir.z < 0 };
+	// Follow ray through BVH nodes to find primitive intersections
+	bool hit = false;
+	int toVisitOffset = 0, currentNodeIndex = 0;
+	int nodesToVisit[64];
+	while (true)
+	{
+		const LinearBVHNode* node = &nodes[currentNodeIndex];
+		if (node->bounds.IntersectP(orig, invDir, dirIsNeg, tNear))
+		{
+			if (node->nPrimitives > 0)
+			{
+				for (int i = 0; i < node->nPrimitives; ++i)
+				{
+					const BVHPrimitive& p = primitives[node->primitivesOffset + i];
+					if (p.object->intersectPrimitive(orig, dir, p.index, tNear, index, uv))
+					{
+						hitObject = p.object;
+						hit = true;
+					}
+				}
+				if (toVisitOffset == 0)
+					break;
+				currentNodeIndex = nodesToVisit[--toVisitOffset];
+			}
+			else
+			{
+				// Visit the child on the near side of the split first, the far one is
+				// likely culled by tNear when it is popped
+				if (dirIsNeg[node->axis])
+				{
+					nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+					currentNodeIndex = node->secondChildOffset;
+				}
+				else
+				{
+					nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+					currentNodeIndex = currentNodeIndex + 1;
+				}
+			}
+		}
+		else
+		{
+			if (toVisitOffset == 0)
+				break;
+			currentNodeIndex = nodesToVisit[--toVisitOffset];
+		}
+	}
+	return hit;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "Bounds3.hpp"
+#include "Object.hpp"
+
+#include <array>
+#include <vector>
+
+// BVHAccel Forward Declarations
+struct BVHBuildNode;
+struct BVHPrimitiveInfo;
+
+// One primitive of the scene BVH: the triangles of a mesh are separate primitives, a
+// sphere is one (see Object::primitiveCount)
+struct BVHPrimitive
+{
+	Object* object;
+	uint32_t index;
+};
+
+// Node of the flattened tree. Nodes are stored in depth-first order, so the first
+// child of an interior node directly follows it and only the second child needs
+// an offset; a leaf points at its range of primitives instead.
+struct alignas(32) LinearBVHNode
+{
+	Bounds3 bounds;
+	union
+	{
+		int primitivesOffset;  // leaf
+		int secondChildOffset; // interior
+	};
+	uint16_t nPrimitives;      // 0 -> interior node
+	uint8_t axis;              // interior node: xyz
+	uint8_t pad[1];            // ensure 32 byte total size
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fill half a cache line");
+
+// BVHAccel Declarations
+class BVHAccel
+{
+public:
+	// BVHAccel Public Types
+	enum class SplitMethod { NAIVE, SAH };
+
+	// BVHAccel Public Methods
+	// traversalCost is the SAH cost of a node visit relative to one primitive test.
+	BVHAccel(std::vector<BVHPrimitive> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::SAH, float traversalCost = 1.0f);
+
+	// Closest hit along orig + t * dir with t < tNear; on a hit tNear, hitObject, index and
+	// uv are those of the hit, as Object::intersect returns them
+	bool Intersect(const Vector3f& orig, const Vector3f& dir, float& tNear, Object*& hitObject, uint32_t& index, Vector2f& uv) const;
+
+	// BVHAccel Private Methods
+	BVHBuildNode* recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int parallelDepth);
+	int flattenBVHTree(BVHBuildNode* node);
+	void deleteBVHTree(BVHBuildNode* node);
+
+	// BVHAccel Private Data
+	const int maxPrimsInNode;
+	const SplitMethod splitMethod;
+	const float traversalCost;
+	std::vector<BVHPrimitive> primitives;
+	std::vector<LinearBVHNode> nodes;
+};
+
+struct BVHBuildNode
+{
+	Bounds3 bounds;
+	BVHBuildNode* left;
+	BVHBuildNode* right;
+
+public:
+	int splitAxis = 0, firstPrimOffset = 0, nPrimitives = 0;
+	// BVHBuildNode Public Methods
+	BVHBuildNode()
+	{
+		bounds = Bounds3();
+		left = nullptr; right = nullptr;
+	}
+	void initLeaf(int first, int n, const Bounds3& b)
+	{
+		firstPrimOffset = first;
+		nPrimitives = n;
+		bounds = b;
+	}
+	void initInterior(int axis, BVHBuildNode* c0, BVHBuildNode* c1)
+	{
+		left = c0;
+		right = c1;
+		bounds = Union(c0->bounds, c1->bounds);
+		splitAxis = axis;
+		nPrimitives = 0;
+	}
+};
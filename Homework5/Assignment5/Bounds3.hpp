@@ -0,0 +1,103 @@
+#pragma once
+
+#include "Vector.hpp"
+
+#include <array>
+#include <limits>
+
+// Axis aligned box, empty until something is added to it with Union
+class Bounds3
+{
+public:
+	Vector3f pMin, pMax; // two points to specify the bounding box
+	Bounds3()
+	{
+		float minNum = std::numeric_limits<float>::lowest();
+		float maxNum = std::numeric_limits<float>::max();
+		pMax = Vector3f(minNum, minNum, minNum);
+		pMin = Vector3f(maxNum, maxNum, maxNum);
+	}
+	Bounds3(const Vector3f p)
+		: pMin(p), pMax(p)
+	{
+	}
+	Bounds3(const Vector3f p1, const Vector3f p2)
+	{
+		pMin = Vector3f::Min(p1, p2);
+		pMax = Vector3f::Max(p1, p2);
+	}
+
+	Vector3f Diagonal() const { return pMax - pMin; }
+	int maxExtent() const
+	{
+		Vector3f d = Diagonal();
+		if (d.x > d.y && d.x > d.z)
+			return 0;
+		else if (d.y > d.z)
+			return 1;
+		else
+			return 2;
+	}
+
+	double SurfaceArea() const
+	{
+		Vector3f d = Diagonal();
+		return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+	}
+
+	Vector3f Centroid() const { return 0.5 * pMin + 0.5 * pMax; }
+
+	// Position of p inside the box, 0 at pMin and 1 at pMax on every axis
+	Vector3f Offset(const Vector3f& p) const
+	{
+		Vector3f o = p - pMin;
+		if (pMax.x > pMin.x)
+			o.x /= pMax.x - pMin.x;
+		if (pMax.y > pMin.y)
+			o.y /= pMax.y - pMin.y;
+		if (pMax.z > pMin.z)
+			o.z /= pMax.z - pMin.z;
+		return o;
+	}
+
+	// Slab test of the ray orig + t * dir with invDir = 1 / dir and dirIsNeg[i] = dir[i] < 0.
+	// tMax: the box is rejected if the ray only enters it after tMax (e.g. behind the closest hit so far)
+	inline bool IntersectP(const Vector3f& orig, const Vector3f& invDir, const std::array<int, 3>& dirIsNeg,
+		float tMax = std::numeric_limits<float>::infinity()) const;
+};
+
+// pbrt's gamma(n) = n eps / (1 - n eps) for n = 3, bound on the relative error of three roundings
+constexpr float gamma3 = 3 * std::numeric_limits<float>::epsilon() * 0.5f / (1 - 3 * std::numeric_limits<float>::epsilon() * 0.5f);
+
+inline bool Bounds3::IntersectP(const Vector3f& orig, const Vector3f& invDir, const std::array<int, 3>& dirIsNeg, float tMax) const
+{
+	float min_x_time = ((dirIsNeg[0] ? pMax : pMin).x - orig.x) * invDir.x;
+	float max_x_time = ((dirIsNeg[0] ? pMin : pMax).x - orig.x) * invDir.x;
+	float min_y_time = ((dirIsNeg[1] ? pMax : pMin).y - orig.y) * invDir.y;
+	float max_y_time = ((dirIsNeg[1] ? pMin : pMax).y - orig.y) * invDir.y;
+	float min_z_time = ((dirIsNeg[2] ? pMax : pMin).z - orig.z) * invDir.z;
+	float max_z_time = ((dirIsNeg[2] ? pMin : pMax).z - orig.z) * invDir.z;
+
+	float enter_time = std::max(min_x_time, std::max(min_y_time, min_z_time));
+	// Widened by the rounding error bound of the slab distances (1 + 2 gamma(3) as in pbrt).
+	// Flat boxes, e.g. around the ground plane, would otherwise lose the rays that hit an
+	// edge of their primitives, where the distances to two slabs are equal.
+	float leave_time = std::min(max_x_time, std::min(max_y_time, max_z_time)) * (1 + 2 * gamma3);
+	return leave_time >= 0 && enter_time <= leave_time && enter_time <= tMax;
+}
+
+inline Bounds3 Union(const Bounds3& b1, const Bounds3& b2)
+{
+	Bounds3 ret;
+	ret.pMin = Vector3f::Min(b1.pMin, b2.pMin);
+	ret.pMax = Vector3f::Max(b1.pMax, b2.pMax);
+	return ret;
+}
+
+inline Bounds3 Union(const Bounds3& b, const Vector3f& p)
+{
+	Bounds3 ret;
+	ret.pMin = Vector3f::Min(b.pMin, p);
+	ret.pMax = Vector3f::Max(b.pMax, p);
+	return ret;
+}
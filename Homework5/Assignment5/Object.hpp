@@ -1,5 +1,6 @@
 #pragma once
 
+#include "Bounds3.hpp"
 #include "Vector.hpp"
 #include "global.hpp"
 
@@ -15,6 +16,23 @@ public:
 
 	virtual bool intersect(const Vector3f&, const Vector3f&, float&, uint32_t&, Vector2f&) const = 0;
 
+	// The scene BVH bounds every object in primitiveCount() parts, e.g. the triangles of a
+	// mesh. intersectPrimitive tests one of them and only reports a hit closer than tnear.
+	virtual uint32_t primitiveCount() const { return 1; }
+	virtual Bounds3 getBounds(uint32_t primitive) const = 0;
+	virtual bool intersectPrimitive(const Vector3f& orig, const Vector3f& dir, uint32_t, float& tnear, uint32_t& index, Vector2f& uv) const
+	{
+		float t = kInfinity;
+		uint32_t indexK;
+		Vector2f uvK;
+		if (!intersect(orig, dir, t, indexK, uvK) || t >= tnear)
+			return false;
+		tnear = t;
+		index = indexK;
+		uv = uvK;
+		return true;
+	}
+
 	virtual void getSurfaceProperties(const Vector3f&, const Vector3f&, const uint32_t&, const Vector2f&, Vector3f&, Vector2f&) const = 0;
 
 	virtual Vector3f evalDiffuseColor(const Vector2f&) const
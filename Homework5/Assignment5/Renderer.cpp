@@ -2,8 +2,11 @@
 #include "Renderer.hpp"
 #include "Scene.hpp"
 
+#include <atomic>
 #include <fstream>
 #include <optional>
+#include <thread>
+#include <vector>
 
 inline float deg2rad(const float& deg)
 {
@@ -73,37 +76,22 @@ float fresnel(const Vector3f& I, const Vector3f& N, const float& ior)
 }
 
 // [comment]
-// Returns true if the ray intersects an object, false otherwise.
+// Returns the closest hit of the ray, if any.
 //
 // \param orig is the ray origin
 // \param dir is the ray direction
-// \param objects is the list of objects the scene contains
-// \param[out] tNear contains the distance to the cloesest intersected object.
-// \param[out] index stores the index of the intersect triangle if the interesected object is a mesh.
-// \param[out] uv stores the u and v barycentric coordinates of the intersected point
-// \param[out] *hitObject stores the pointer to the intersected object (used to retrieve material information, etc.)
-// \param isShadowRay is it a shadow ray. We can return from the function sooner as soon as we have found a hit.
+// \param scene is the scene, whose BVH finds the closest of its objects
+//
+// The hit holds the distance to the closest intersected object, the index of the intersected
+// triangle if the object is a mesh, the u and v barycentric coordinates of the intersected
+// point and the intersected object (used to retrieve material information, etc.)
 // [/comment]
-std::optional<hit_payload> trace(const Vector3f& orig, const Vector3f& dir, const std::vector<std::unique_ptr<Object> >& objects)
+std::optional<hit_payload> trace(const Vector3f& orig, const Vector3f& dir, const Scene& scene)
 {
-	float tNear = kInfinity;
-	std::optional<hit_payload> payload;
-	for (const auto& object : objects)
-	{
-		float tNearK = kInfinity;
-		uint32_t indexK;
-		Vector2f uvK;
-		if (object->intersect(orig, dir, tNearK, indexK, uvK) && tNearK < tNear)
-		{
-			payload.emplace();
-			payload->hit_obj = object.get();
-			payload->tNear = tNearK;
-			payload->index = indexK;
-			payload->uv = uvK;
-			tNear = tNearK;
-		}
-	}
-
+	hit_payload payload;
+	payload.tNear = kInfinity;
+	if (!scene.intersect(orig, dir, payload.tNear, payload.hit_obj, payload.index, payload.uv))
+		return std::nullopt;
 	return payload;
 }
 
@@ -111,31 +99,50 @@ std::optional<hit_payload> trace(const Vector3f& orig, const Vector3f& dir, cons
 // Implementation of the Whitted-style light transport algorithm (E [S*] (D|G) L)
 //
 // This function is the function that compute the color at the intersection point
-// of a ray defined by a position and a direction. Note that thus function is recursive (it calls itself).
+// of a ray defined by a position and a direction. Rather than calling itself for the
+// reflected and refracted rays, it keeps them on a stack together with their weight, the
+// share of the pixel color they bring, and adds up what every traced ray contributes.
+// Rays deeper than scene.maxDepth are not traced.
 //
 // If the material of the intersected object is either reflective or reflective and refractive,
-// then we compute the reflection/refraction direction and cast two new rays into the scene
-// by calling the castRay() function recursively. When the surface is transparent, we mix
-// the reflection and refraction color using the result of the fresnel equations (it computes
-// the amount of reflection and refraction depending on the surface normal, incident view direction
-// and surface refractive index).
+// then we compute the reflection/refraction direction and cast two new rays into the scene.
+// When the surface is transparent, we mix the reflection and refraction color using the result
+// of the fresnel equations (it computes the amount of reflection and refraction depending on the
+// surface normal, incident view direction and surface refractive index).
 //
 // If the surface is diffuse/glossy we use the Phong illumation model to compute the color
 // at the intersection point.
 // [/comment]
-Vector3f castRay(const Vector3f& orig, const Vector3f& dir, const Scene& scene, int depth)
+Vector3f castRay(const Vector3f& orig, const Vector3f& dir, const Scene& scene)
 {
-	if (depth > scene.maxDepth) {
-		return Vector3f(0.0, 0.0, 0.0);
-	}
-
-	Vector3f hitColor = scene.backgroundColor;
-	if (auto payload = trace(orig, dir, scene.get_objects()); payload)
+	struct PendingRay
 	{
-		Vector3f hitPoint = orig + dir * payload->tNear;
+		Vector3f orig, dir;
+		float weight;
+		int depth;
+	};
+	// Every hit pushes at most two rays and the last one pushed is traced next, so the stack
+	// never holds more than one waiting ray per depth and stays small
+	thread_local std::vector<PendingRay> stack;
+	stack.clear();
+	stack.push_back({ orig, dir, 1.0f, 0 });
+
+	Vector3f color = 0;
+	while (!stack.empty()) {
+		PendingRay ray = stack.back();
+		stack.pop_back();
+		auto payload = trace(ray.orig, ray.dir, scene);
+		if (!payload) {
+			color += scene.backgroundColor * ray.weight;
+			continue;
+		}
+
+		const Vector3f& dir = ray.dir;
+		Vector3f hitPoint = ray.orig + dir * payload->tNear;
 		Vector3f N; // normal
 		Vector2f st; // st coordinates
 		payload->hit_obj->getSurfaceProperties(hitPoint, dir, payload->index, payload->uv, N, st);
+		bool traceDeeper = ray.depth < scene.maxDepth;
 		switch (payload->hit_obj->materialType) {
 		case REFLECTION_AND_REFRACTION:
 		{
@@ -143,10 +150,11 @@ Vector3f castRay(const Vector3f& orig, const Vector3f& dir, const Scene& scene,
 			Vector3f refractionDirection = normalize(refract(dir, N, payload->hit_obj->ior));
 			Vector3f reflectionRayOrig = (dotProduct(reflectionDirection, N) < 0) ? hitPoint - N * scene.epsilon : hitPoint + N * scene.epsilon;
 			Vector3f refractionRayOrig = (dotProduct(refractionDirection, N) < 0) ? hitPoint - N * scene.epsilon : hitPoint + N * scene.epsilon;
-			Vector3f reflectionColor = castRay(reflectionRayOrig, reflectionDirection, scene, depth + 1);
-			Vector3f refractionColor = castRay(refractionRayOrig, refractionDirection, scene, depth + 1);
 			float kr = fresnel(dir, N, payload->hit_obj->ior);
-			hitColor = reflectionColor * kr + refractionColor * (1 - kr);
+			if (traceDeeper) {
+				stack.push_back({ refractionRayOrig, refractionDirection, ray.weight * (1 - kr), ray.depth + 1 });
+				stack.push_back({ reflectionRayOrig, reflectionDirection, ray.weight * kr, ray.depth + 1 });
+			}
 			break;
 		}
 		case REFLECTION:
@@ -154,7 +162,8 @@ Vector3f castRay(const Vector3f& orig, const Vector3f& dir, const Scene& scene,
 			float kr = fresnel(dir, N, payload->hit_obj->ior);
 			Vector3f reflectionDirection = reflect(dir, N);
 			Vector3f reflectionRayOrig = (dotProduct(reflectionDirection, N) < 0) ? hitPoint + N * scene.epsilon : hitPoint - N * scene.epsilon;
-			hitColor = castRay(reflectionRayOrig, reflectionDirection, scene, depth + 1) * kr;
+			if (traceDeeper)
+				stack.push_back({ reflectionRayOrig, reflectionDirection, ray.weight * kr, ray.depth + 1 });
 			break;
 		}
 		default:
@@ -176,7 +185,7 @@ Vector3f castRay(const Vector3f& orig, const Vector3f& dir, const Scene& scene,
 				lightDir = normalize(lightDir);
 				float LdotN = std::max(0.f, dotProduct(lightDir, N));
 				// is the point in shadow, and is the nearest occluding object closer to the object than the light itself?
-				auto shadow_res = trace(shadowPointOrig, lightDir, scene.get_objects());
+				auto shadow_res = trace(shadowPointOrig, lightDir, scene);
 				bool inShadow = shadow_res && (shadow_res->tNear * shadow_res->tNear < lightDistance2);
 
 				lightAmt += inShadow ? 0 : light->intensity * LdotN;
@@ -185,19 +194,21 @@ Vector3f castRay(const Vector3f& orig, const Vector3f& dir, const Scene& scene,
 				specularColor += powf(std::max(0.f, -dotProduct(reflectionDirection, dir)), payload->hit_obj->specularExponent) * light->intensity;
 			}
 
-			hitColor = lightAmt * payload->hit_obj->evalDiffuseColor(st) * payload->hit_obj->Kd + specularColor * payload->hit_obj->Ks;
+			Vector3f hitColor = lightAmt * payload->hit_obj->evalDiffuseColor(st) * payload->hit_obj->Kd + specularColor * payload->hit_obj->Ks;
+			color += hitColor * ray.weight;
 			break;
 		}
 		}
 	}
 
-	return hitColor;
+	return color;
 }
 
 // [comment]
 // The main render function. This where we iterate over all pixels in the image, generate
-// primary rays and cast these rays into the scene. The content of the framebuffer is
-// saved to a file.
+// primary rays and cast these rays into the scene. The image is cut into square tiles
+// that a pool of threads pull from a shared counter, so faster threads simply take more
+// tiles. The content of the framebuffer is saved to a file.
 // [/comment]
 void Renderer::Render(const Scene& scene)
 {
@@ -208,37 +219,62 @@ void Renderer::Render(const Scene& scene)
 
 	// Use this variable as the eye position to start your rays.
 	Vector3f eye_pos(0);
-	int m = 0;
-	for (int j = 0; j < scene.height; ++j)
+	auto renderTile = [&](int x0, int y0, int x1, int y1)
 	{
-		for (int i = 0; i < scene.width; ++i)
+		for (int j = y0; j < y1; ++j)
 		{
-			// generate primary ray direction
-			float x;
-			float y;
-			// TODO: Find the x and y positions of the current pixel to get the direction
-			// vector that passes through it.
-			// Also, don't forget to multiply both of them with the variable *scale*, and
-			// x (horizontal) variable with the *imageAspectRatio*            
-			x = ((i + 0.5f) * 2.0f / scene.width - 1.0f) * scale * imageAspectRatio;
-			y = (1.0f - (j + 0.5f) * 2.0f / scene.height) * scale;
-
-			Vector3f dir = Vector3f(x, y, -1); // Don't forget to normalize this direction!
-			dir = normalize(dir);
-			framebuffer[m++] = castRay(eye_pos, dir, scene, 0);
+			for (int i = x0; i < x1; ++i)
+			{
+				// generate primary ray direction
+				float x;
+				float y;
+				// TODO: Find the x and y positions of the current pixel to get the direction
+				// vector that passes through it.
+				// Also, don't forget to multiply both of them with the variable *scale*, and
+				// x (horizontal) variable with the *imageAspectRatio*
+				x = ((i + 0.5f) * 2.0f / scene.width - 1.0f) * scale * imageAspectRatio;
+				y = (1.0f - (j + 0.5f) * 2.0f / scene.height) * scale;
+
+				Vector3f dir = Vector3f(x, y, -1); // Don't forget to normalize this direction!
+				dir = normalize(dir);
+				framebuffer[j * scene.width + i] = castRay(eye_pos, dir, scene);
+			}
 		}
-		UpdateProgress(j / (float)scene.height);
-	}
+	};
 
-	// save framebuffer to file
-	FILE* fp = fopen("binary.ppm", "wb");
-	(void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
+	int tilesX = (scene.width + tileSize - 1) / tileSize;
+	int tilesY = (scene.height + tileSize - 1) / tileSize;
+	int tileCount = tilesX * tilesY;
+	std::atomic<int> nextTile(0);
+	std::atomic<int> finishedTiles(0);
+	auto worker = [&]()
+	{
+		for (int t = nextTile++; t < tileCount; t = nextTile++)
+		{
+			int x0 = (t % tilesX) * tileSize;
+			int y0 = (t / tilesX) * tileSize;
+			renderTile(x0, y0, std::min(x0 + tileSize, scene.width), std::min(y0 + tileSize, scene.height));
+			UpdateProgress(++finishedTiles / (float)tileCount);
+		}
+	};
+
+	int threadCount = numThreads > 0 ? numThreads : std::max(1u, std::thread::hardware_concurrency());
+	std::vector<std::thread> threads;
+	for (int t = 1; t < std::min(threadCount, tileCount); ++t)
+		threads.emplace_back(worker);
+	worker();
+	for (auto& thread : threads)
+		thread.join();
+
+	// save framebuffer to file, in one write
+	std::vector<unsigned char> pixels(scene.height * scene.width * 3);
 	for (auto i = 0; i < scene.height * scene.width; ++i) {
-		static unsigned char color[3];
-		color[0] = (char)(255 * clamp(0, 1, framebuffer[i].x));
-		color[1] = (char)(255 * clamp(0, 1, framebuffer[i].y));
-		color[2] = (char)(255 * clamp(0, 1, framebuffer[i].z));
-		fwrite(color, 1, 3, fp);
+		pixels[i * 3] = (unsigned char)(255 * clamp(0, 1, framebuffer[i].x));
+		pixels[i * 3 + 1] = (unsigned char)(255 * clamp(0, 1, framebuffer[i].y));
+		pixels[i * 3 + 2] = (unsigned char)(255 * clamp(0, 1, framebuffer[i].z));
 	}
+	FILE* fp = fopen("binary.ppm", "wb");
+	(void)fprintf(fp, "P6\n%d %d\n255\n", scene.width, scene.height);
+	fwrite(pixels.data(), 1, pixels.size(), fp);
 	fclose(fp);
 }
@@ -13,5 +13,9 @@ struct hit_payload
 class Renderer
 {
 public:
+    // setting up options
+    int tileSize = 32;
+    int numThreads = 0; // 0 means one thread per hardware core
+
     void Render(const Scene& scene);
 };
@@ -3,3 +3,15 @@
 //
 
 #include "Scene.hpp"
+
+void Scene::buildBVH()
+{
+	std::vector<BVHPrimitive> primitives;
+	for (const auto& object : objects)
+	{
+		for (uint32_t i = 0; i < object->primitiveCount(); ++i)
+			primitives.push_back({ object.get(), i });
+	}
+	// leaves of up to 4 primitives, a node visit costs about as much as a primitive test
+	bvh = std::make_unique<BVHAccel>(std::move(primitives), 4, BVHAccel::SplitMethod::SAH, 1.0f);
+}
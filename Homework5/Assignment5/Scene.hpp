@@ -1,5 +1,6 @@
 #pragma once
 
+#include "BVH.hpp"
 #include "Vector.hpp"
 #include "Object.hpp"
 #include "Light.hpp"
@@ -26,6 +27,14 @@ public:
 	void Add(std::unique_ptr<Object> object) { objects.push_back(std::move(object)); }
 	void Add(std::unique_ptr<Light> light) { lights.push_back(std::move(light)); }
 
+	// Build the BVH over the objects added so far, intersect uses it afterwards
+	void buildBVH();
+	// Closest hit along orig + t * dir with t < tNear
+	bool intersect(const Vector3f& orig, const Vector3f& dir, float& tNear, Object*& hitObject, uint32_t& index, Vector2f& uv) const
+	{
+		return bvh && bvh->Intersect(orig, dir, tNear, hitObject, index, uv);
+	}
+
 	[[nodiscard]] const std::vector<std::unique_ptr<Object> >& get_objects() const { return objects; }
 	[[nodiscard]] const std::vector<std::unique_ptr<Light> >& get_lights() const { return lights; }
 
@@ -33,4 +42,5 @@ private:
 	// creating the scene (adding objects and lights)
 	std::vector<std::unique_ptr<Object> > objects;
 	std::vector<std::unique_ptr<Light> > lights;
+	std::unique_ptr<BVHAccel> bvh;
 };
@@ -30,6 +30,11 @@ public:
 		return true;
 	}
 
+	Bounds3 getBounds(uint32_t) const override
+	{
+		return Bounds3(center - Vector3f(radius), center + Vector3f(radius));
+	}
+
 	void getSurfaceProperties(const Vector3f& P, const Vector3f&, const uint32_t&, const Vector2f&, Vector3f& N, Vector2f&) const override
 	{
 		N = normalize(P - center);
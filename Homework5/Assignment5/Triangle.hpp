@@ -70,6 +70,25 @@ public:
 		return intersect;
 	}
 
+	uint32_t primitiveCount() const override { return numTriangles; }
+
+	Bounds3 getBounds(uint32_t k) const override
+	{
+		return Union(Bounds3(vertices[vertexIndex[k * 3]], vertices[vertexIndex[k * 3 + 1]]), vertices[vertexIndex[k * 3 + 2]]);
+	}
+
+	bool intersectPrimitive(const Vector3f& orig, const Vector3f& dir, uint32_t k, float& tnear, uint32_t& index, Vector2f& uv) const override
+	{
+		float t, u, v;
+		if (!rayTriangleIntersect(vertices[vertexIndex[k * 3]], vertices[vertexIndex[k * 3 + 1]], vertices[vertexIndex[k * 3 + 2]], orig, dir, t, u, v) || t >= tnear)
+			return false;
+		tnear = t;
+		uv.x = u;
+		uv.y = v;
+		index = k;
+		return true;
+	}
+
 	void getSurfaceProperties(const Vector3f&, const Vector3f&, const uint32_t& index, const Vector2f& uv, Vector3f& N, Vector2f& st) const override
 	{
 		const Vector3f& v0 = vertices[vertexIndex[index * 3]];
@@ -2,6 +2,7 @@
 
 #include <cmath>
 #include <iostream>
+#include <mutex>
 #include <random>
 
 #define M_PI 3.14159265358979323846
@@ -49,6 +50,9 @@ inline float get_random_float()
 
 inline void UpdateProgress(float progress)
 {
+	static std::mutex mutex;
+	std::lock_guard<std::mutex> lock(mutex);
+
 	int barWidth = 70;
 
 	std::cout << "[";
@@ -4,6 +4,9 @@
 #include "Light.hpp"
 #include "Renderer.hpp"
 
+#include <chrono>
+#include <iostream>
+
 // In the main function of the program, we create the scene (create objects and lights)
 // as well as set the options for the render (image width and height, maximum recursion
 // depth, field-of-view, etc.). We then call the render function().
@@ -32,8 +35,15 @@ int main()
     scene.Add(std::make_unique<Light>(Vector3f(-20, 70, 20), 0.5));
     scene.Add(std::make_unique<Light>(Vector3f(30, 50, -12), 0.5));    
 
+    scene.buildBVH();
+
     Renderer r;
+
+    auto start = std::chrono::steady_clock::now();
     r.Render(scene);
+    auto stop = std::chrono::steady_clock::now();
+
+    std::cout << "\nRender complete: " << std::chrono::duration<double, std::milli>(stop - start).count() << " ms\n";
 
     return 0;
 }
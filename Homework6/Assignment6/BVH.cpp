@@ -2,16 +2,62 @@
 
 #include <algorithm>
 #include <cassert>
+#include <future>
+#include <thread>
 
-BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod splitMethod)
-	: maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod), primitives(std::move(p))
+// Bounds and centroid of one primitive, computed once before the build so the
+// split code never calls back into the (virtual) objects
+struct BVHPrimitiveInfo
+{
+	BVHPrimitiveInfo() {}
+	BVHPrimitiveInfo(size_t primitiveNumber, const Bounds3& bounds)
+		: primitiveNumber(primitiveNumber), bounds(bounds), centroid(0.5f * bounds.pMin + 0.5f * bounds.pMax)
+	{
+	}
+	size_t primitiveNumber;
+	Bounds3 bounds;
+	Vector3f centroid;
+};
+
+// One bin of the SAH sweep
+struct Bucket
+{
+	int count = 0;
+	Bounds3 bounds;
+};
+
+static constexpr int nBuckets = 16;
+// subtrees smaller than this are not worth a task of their own
+static constexpr int parallelBuildThreshold = 4096;
+
+BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod splitMethod, float traversalCost)
+	: maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod), traversalCost(traversalCost), primitives(std::move(p))
 {
 	time_t start, stop;
 	time(&start);
 	if (primitives.empty())
 		return;
 
-	root = recursiveBuild(primitives);
+	std::vector<BVHPrimitiveInfo> primitiveInfo(primitives.size());
+	for (size_t i = 0; i < primitives.size(); ++i)
+		primitiveInfo[i] = BVHPrimitiveInfo(i, primitives[i]->getBounds());
+
+	// Build subtrees concurrently for the first few levels, one level per doubling of cores
+	int parallelDepth = 0;
+	for (unsigned int n = std::thread::hardware_concurrency(); n > 1; n >>= 1)
+		++parallelDepth;
+	BVHBuildNode* root = recursiveBuild(primitiveInfo, 0, primitives.size(), parallelDepth);
+
+	// The build only permutes primitiveInfo, leaves reference ranges of it
+	std::vector<Object*> orderedPrims(primitives.size());
+	for (size_t i = 0; i < primitiveInfo.size(); ++i)
+		orderedPrims[i] = primitives[primitiveInfo[i].primitiveNumber];
+	primitives.swap(orderedPrims);
+
+	// Flatten the tree into a depth-first array, the linked build nodes are no longer needed afterwards
+	nodes.reserve(2 * primitives.size());
+	flattenBVHTree(root);
+	deleteBVHTree(root);
 
 	time(&stop);
 	double diff = difftime(stop, start);
@@ -22,109 +68,212 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod split
 	printf("\rBVH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n", hrs, mins, secs);
 }
 
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int parallelDepth)
 {
 	BVHBuildNode* node = new BVHBuildNode();
 
 	// Compute bounds of all primitives in BVH node
 	Bounds3 bounds;
-	for (int i = 0; i < objects.size(); ++i)
+	for (int i = start; i < end; ++i)
+		bounds = Union(bounds, primitiveInfo[i].bounds);
+	int nPrimitives = end - start;
+	if (nPrimitives == 1)
 	{
-		bounds = Union(bounds, objects[i]->getBounds());
-	}
-
-	if (objects.size() == 1) {
 		// Create leaf _BVHBuildNode_
-		node->bounds = objects[0]->getBounds();
-		node->object = objects[0];
-		node->left = nullptr;
-		node->right = nullptr;
+		node->initLeaf(start, nPrimitives, bounds);
 		return node;
 	}
-	else if (objects.size() == 2) {
-		node->left = recursiveBuild(std::vector{ objects[0] });
-		node->right = recursiveBuild(std::vector{ objects[1] });
 
-		node->bounds = Union(node->left->bounds, node->right->bounds);
+	Bounds3 centroidBounds;
+	for (int i = start; i < end; ++i)
+		centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+	int dim = centroidBounds.maxExtent();
+	const Vector3f centroidExtent = centroidBounds.Diagonal();
+
+	// Partition primitives into two sets and build children
+	int mid = (start + end) / 2;
+	if ((splitMethod == SplitMethod::NAIVE || centroidExtent[dim] == 0) && nPrimitives <= maxPrimsInNode)
+	{
+		node->initLeaf(start, nPrimitives, bounds);
 		return node;
 	}
-	else {
-		Bounds3 centroidBounds;
-		for (int i = 0; i < objects.size(); ++i)
+	if (centroidExtent[dim] == 0)
+	{
+		// All centroids coincide, no split plane separates them: just halve the range
+	}
+	else if (splitMethod == SplitMethod::NAIVE || nPrimitives <= 2)
+	{
+		// Partition primitives into equally-sized subsets
+		std::nth_element(&primitiveInfo[start], &primitiveInfo[mid], &primitiveInfo[end - 1] + 1,
+			[dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b)
+			{
+				return a.centroid[dim] < b.centroid[dim];
+			});
+	}
+	else
+	{
+		// Partition primitives using approximate SAH
+		Bucket buckets[nBuckets];
+		auto bucketOf = [&](const BVHPrimitiveInfo& pi)
 		{
-			centroidBounds = Union(centroidBounds, objects[i]->getBounds().Centroid());
+			const Vector3f offset = centroidBounds.Offset(pi.centroid);
+			return std::min(nBuckets - 1, (int)(nBuckets * offset[dim]));
+		};
+		for (int i = start; i < end; ++i)
+		{
+			int b = bucketOf(primitiveInfo[i]);
+			buckets[b].count++;
+			buckets[b].bounds = Union(buckets[b].bounds, primitiveInfo[i].bounds);
 		}
 
-		int dim = centroidBounds.maxExtent();
-		if (this->splitMethod == SplitMethod::NAIVE)
+		// Sweep the buckets from both sides to get the cost of splitting after each one
+		float cost[nBuckets - 1];
+		Bounds3 b0;
+		int count0 = 0;
+		for (int i = 0; i < nBuckets - 1; ++i)
 		{
-			switch (dim)
-			{
-				case 0:
-					std::sort(objects.begin(), objects.end(), [](auto f1, auto f2)
-						{
-							return f1->getBounds().Centroid().x < f2->getBounds().Centroid().x;
-						});
-					break;
-				case 1:
-					std::sort(objects.begin(), objects.end(), [](auto f1, auto f2)
-						{
-							return f1->getBounds().Centroid().y < f2->getBounds().Centroid().y;
-						});
-					break;
-				case 2:
-					std::sort(objects.begin(), objects.end(), [](auto f1, auto f2)
-						{
-							return f1->getBounds().Centroid().z < f2->getBounds().Centroid().z;
-						});
-					break;
-			}
+			b0 = Union(b0, buckets[i].bounds);
+			count0 += buckets[i].count;
+			cost[i] = count0 > 0 ? count0 * b0.SurfaceArea() : 0;
 		}
-		else if(this->splitMethod == SplitMethod::SAH)
+		Bounds3 b1;
+		int count1 = 0;
+		for (int i = nBuckets - 1; i > 0; --i)
 		{
-
+			b1 = Union(b1, buckets[i].bounds);
+			count1 += buckets[i].count;
+			cost[i - 1] += count1 > 0 ? count1 * b1.SurfaceArea() : 0;
 		}
 
-		auto beginning = objects.begin();
-		auto middling = objects.begin() + (objects.size() / 2);
-		auto ending = objects.end();
-
-		auto leftshapes = std::vector<Object*>(beginning, middling);
-		auto rightshapes = std::vector<Object*>(middling, ending);
-
-		assert(objects.size() == (leftshapes.size() + rightshapes.size()));
+		int minCostSplitBucket = 0;
+		for (int i = 1; i < nBuckets - 1; ++i)
+		{
+			if (cost[i] < cost[minCostSplitBucket])
+				minCostSplitBucket = i;
+		}
+		float minCost = traversalCost + cost[minCostSplitBucket] / bounds.SurfaceArea();
 
-		node->left = recursiveBuild(leftshapes);
-		node->right = recursiveBuild(rightshapes);
+		// Either create leaf or split primitives at selected SAH bucket. Leaves never hold
+		// more than maxPrimsInNode primitives, larger ranges are split even when no split pays off.
+		float leafCost = nPrimitives;
+		if (nPrimitives <= maxPrimsInNode && minCost >= leafCost)
+		{
+			node->initLeaf(start, nPrimitives, bounds);
+			return node;
+		}
+		BVHPrimitiveInfo* pmid = std::partition(&primitiveInfo[start], &primitiveInfo[end - 1] + 1,
+			[&](const BVHPrimitiveInfo& pi)
+			{
+				return bucketOf(pi) <= minCostSplitBucket;
+			});
+		mid = pmid - &primitiveInfo[0];
+	}
 
-		node->bounds = Union(node->left->bounds, node->right->bounds);
+	BVHBuildNode* left;
+	BVHBuildNode* right;
+	if (parallelDepth > 0 && nPrimitives >= parallelBuildThreshold)
+	{
+		auto leftTask = std::async(std::launch::async, [&]()
+			{
+				return recursiveBuild(primitiveInfo, start, mid, parallelDepth - 1);
+			});
+		right = recursiveBuild(primitiveInfo, mid, end, parallelDepth - 1);
+		left = leftTask.get();
 	}
+	else
+	{
+		left = recursiveBuild(primitiveInfo, start, mid, 0);
+		right = recursiveBuild(primitiveInfo, mid, end, 0);
+	}
+	node->initInterior(dim, left, right);
 
 	return node;
 }
 
-Intersection BVHAccel::Intersect(const Ray& ray) const
+int BVHAccel::flattenBVHTree(BVHBuildNode* node)
 {
-	Intersection isect;
-	if (!root)
-		return isect;
-	isect = BVHAccel::getIntersection(root, ray);
-	return isect;
+	int myOffset = nodes.size();
+	nodes.emplace_back();
+	nodes[myOffset].bounds = node->bounds;
+	if (node->nPrimitives > 0)
+	{
+		nodes[myOffset].primitivesOffset = node->firstPrimOffset;
+		nodes[myOffset].nPrimitives = node->nPrimitives;
+	}
+	else
+	{
+		// Create interior flattened BVH node
+		nodes[myOffset].axis = node->splitAxis;
+		nodes[myOffset].nPrimitives = 0;
+		flattenBVHTree(node->left);
+		int secondChildOffset = flattenBVHTree(node->right);
+		nodes[myOffset].secondChildOffset = secondChildOffset;
+	}
+	return myOffset;
 }
 
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+void BVHAccel::deleteBVHTree(BVHBuildNode* node)
 {
-	// TODO Traverse the BVH to find intersection
+	if (!node)
+		return;
+	deleteBVHTree(node->left);
+	deleteBVHTree(node->right);
+	delete node;
+}
 
+Intersection BVHAccel::Intersect(const Ray& ray) const
+{
 	Intersection isect;
-	std::array<int, 3> dirIsNeg = { ray.direction.x < 0, ray.direction.y < 0, ray.direction.z < 0 };
-	if (!node->bounds.IntersectP(ray, ray.direction_inv, dirIsNeg))
+	if (nodes.empty())
 		return isect;
 
-	if (!node->left && !node->right)
-		return node->object->getIntersection(ray);
-
-	Intersection left_isect = BVHAccel::getIntersection(node->left, ray);
-	Intersection right_isect = BVHAccel::getIntersection(node->right, ray);
-	return left_isect.distance < right_isect.distance ? left_isect : right_isect;
+	std::array<int, 3> dirIsNeg = { ray.direction.x < 0, ray.direction.y < 0, ray.direction.z < 0 };
+	// Follow ray through BVH nodes to find primitive intersections
+	int toVisitOffset = 0, currentNodeIndex = 0;
+	int nodesToVisit[64];
+	float tClosest = std::numeric_limits<float>::infinity();
+	while (true)
+	{
+		const LinearBVHNode* node = &nodes[currentNodeIndex];
+		if (node->bounds.IntersectP(ray, ray.direction_inv, dirIsNeg, tClosest))
+		{
+			if (node->nPrimitives > 0)
+			{
+				for (int i = 0; i < node->nPrimitives; ++i)
+				{
+					Intersection hit = primitives[node->primitivesOffset + i]->getIntersection(ray);
+					if (hit.happened && hit.distance < isect.distance)
+					{
+						isect = hit;
+						tClosest = hit.distance;
+					}
+				}
+				if (toVisitOffset == 0)
+					break;
+				currentNodeIndex = nodesToVisit[--toVisitOffset];
+			}
+			else
+			{
+				// Visit the child on the near side of the split first, the far one is
+				// likely culled by tClosest when it is popped
+				if (dirIsNeg[node->axis])
+				{
+					nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+					currentNodeIndex = node->secondChildOffset;
+				}
+				else
+				{
+					nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+					currentNodeIndex = currentNodeIndex + 1;
+				}
+			}
+		}
+		else
+		{
+			if (toVisitOffset == 0)
+				break;
+			currentNodeIndex = nodesToVisit[--toVisitOffset];
+		}
+	}
+	return isect;
 }
@@ -18,6 +18,24 @@
 
 // BVHAccel Forward Declarations
 struct BVHBuildNode;
+struct BVHPrimitiveInfo;
+
+// Node of the flattened tree. Nodes are stored in depth-first order, so the first
+// child of an interior node directly follows it and only the second child needs
+// an offset; a leaf points at its range of primitives instead.
+struct alignas(32) LinearBVHNode
+{
+	Bounds3 bounds;
+	union
+	{
+		int primitivesOffset;  // leaf
+		int secondChildOffset; // interior
+	};
+	uint16_t nPrimitives;      // 0 -> interior node
+	uint8_t axis;              // interior node: xyz
+	uint8_t pad[1];            // ensure 32 byte total size
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fill half a cache line");
 
 // BVHAccel Declarations
 inline int leafNodes, totalLeafNodes, totalPrimitives, interiorNodes;
@@ -28,26 +46,29 @@ public:
 	enum class SplitMethod { NAIVE, SAH };
 
 	// BVHAccel Public Methods
+	// traversalCost is the SAH cost of a node visit relative to one primitive test.
 #if USE_SAH
-	BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::SAH);
+	BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::SAH, float traversalCost = 1.0f);
 #else
-	BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+	BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE, float traversalCost = 1.0f);
 #endif
 	Bounds3 WorldBound() const;
 	~BVHAccel();
 
 	Intersection Intersect(const Ray& ray) const;
-	Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
 	bool IntersectP(const Ray& ray) const;
-	BVHBuildNode* root;
 
 	// BVHAccel Private Methods
-	BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+	BVHBuildNode* recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int parallelDepth);
+	int flattenBVHTree(BVHBuildNode* node);
+	void deleteBVHTree(BVHBuildNode* node);
 
 	// BVHAccel Private Data
 	const int maxPrimsInNode;
 	const SplitMethod splitMethod;
+	const float traversalCost;
 	std::vector<Object*> primitives;
+	std::vector<LinearBVHNode> nodes;
 };
 
 struct BVHBuildNode
@@ -55,7 +76,6 @@ struct BVHBuildNode
 	Bounds3 bounds;
 	BVHBuildNode* left;
 	BVHBuildNode* right;
-	Object* object;
 
 public:
 	int splitAxis = 0, firstPrimOffset = 0, nPrimitives = 0;
@@ -64,15 +84,21 @@ public:
 	{
 		bounds = Bounds3();
 		left = nullptr; right = nullptr;
-		object = nullptr;
 	}
-};
-
-struct Bucket
-{
-	Bounds3 bounds;
-	int count;
-	std::vector<Object*> objects;
+	void initLeaf(int first, int n, const Bounds3& b)
+	{
+		firstPrimOffset = first;
+		nPrimitives = n;
+		bounds = b;
+	}
+	void initInterior(int axis, BVHBuildNode* c0, BVHBuildNode* c1)
+	{
+		left = c0;
+		right = c1;
+		bounds = Union(c0->bounds, c1->bounds);
+		splitAxis = axis;
+		nPrimitives = 0;
+	}
 };
 
 #endif //RAYTRACING_BVH_H
@@ -86,11 +86,13 @@ public:
 		return (i == 0) ? pMin : pMax;
 	}
 
-	inline bool IntersectP(const Ray& ray, const Vector3f& invDir, const std::array<int, 3>& dirisNeg) const;
+	// tMax: the box is rejected if the ray only enters it after tMax (e.g. behind the closest hit so far)
+	inline bool IntersectP(const Ray& ray, const Vector3f& invDir, const std::array<int, 3>& dirisNeg,
+		float tMax = std::numeric_limits<float>::infinity()) const;
 };
 
 
-inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir, const std::array<int, 3>& dirIsNeg) const
+inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir, const std::array<int, 3>& dirIsNeg, float tMax) const
 {
 	// invDir: ray direction(x,y,z), invDir=(1.0/x,1.0/y,1.0/z), use this because Multiply is faster that Division
 	// dirIsNeg: ray direction(x,y,z), dirIsNeg=[int(x>0),int(y>0),int(z>0)], use this to simplify your logic
@@ -135,7 +137,7 @@ inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir, const st
 	if (leave_time > max_z_time)
 		leave_time = max_z_time;
 
-	if (leave_time >= 0 && enter_time <= leave_time)
+	if (leave_time >= 0 && enter_time <= leave_time && enter_time <= tMax)
 		return true;
 	return false;
 }
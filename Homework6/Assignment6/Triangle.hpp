@@ -3,12 +3,12 @@
 #include "BVH.hpp"
 #include "Intersection.hpp"
 #include "Material.hpp"
-#include "OBJ_Loader.hpp"
+#include "ObjLoader.hpp"
 #include "Object.hpp"
 #include "Triangle.hpp"
 
-#include <cassert>
 #include <array>
+#include <stdexcept>
 
 bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1, const Vector3f& v2, const Vector3f& orig, const Vector3f& dir, float& tnear, float& u, float& v)
 {
@@ -71,13 +71,15 @@ public:
 class MeshTriangle : public Object
 {
 public:
+	// SAH cost of a node visit relative to one triangle test, see BVHAccel; a traversal
+	// step is cheap next to a (virtual) triangle test
+	static constexpr float bvhTraversalCost = 0.125f;
+
 	MeshTriangle(const std::string& filename)
 	{
-		objl::Loader loader;
-		loader.LoadFile(filename);
-
-		assert(loader.LoadedMeshes.size() == 1);
-		auto mesh = loader.LoadedMeshes[0];
+		ObjMesh mesh;
+		if (!LoadObj(filename, mesh, false))
+			throw std::runtime_error("cannot load " + filename);
 
 		Vector3f min_vert = Vector3f{ std::numeric_limits<float>::infinity(),
 									 std::numeric_limits<float>::infinity(),
@@ -85,12 +87,11 @@ public:
 		Vector3f max_vert = Vector3f{ -std::numeric_limits<float>::infinity(),
 									 -std::numeric_limits<float>::infinity(),
 									 -std::numeric_limits<float>::infinity() };
-		for (int i = 0; i < mesh.Vertices.size(); i += 3) {
+		for (size_t i = 0; i < mesh.indices.size(); i += 3) {
 			std::array<Vector3f, 3> face_vertices;
 			for (int j = 0; j < 3; j++) {
-				auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-					mesh.Vertices[i + j].Position.Y,
-					mesh.Vertices[i + j].Position.Z) * 60.f;
+				uint32_t id = mesh.indices[i + j];
+				auto vert = Vector3f(mesh.px[id], mesh.py[id], mesh.pz[id]) * 60.f;
 				face_vertices[j] = vert;
 
 				min_vert = Vector3f(std::min(min_vert.x, vert.x),
@@ -115,7 +116,7 @@ public:
 		for (auto& tri : triangles)
 			ptrs.push_back(&tri);
 
-		bvh = new BVHAccel(ptrs);
+		bvh = new BVHAccel(ptrs, 4, USE_SAH ? BVHAccel::SplitMethod::SAH : BVHAccel::SplitMethod::NAIVE, bvhTraversalCost);
 	}
 
 	bool intersect(const Ray& ray) { return true; }
@@ -2,16 +2,94 @@
 
 #include <algorithm>
 #include <cassert>
+#include <future>
+#include <thread>
+
+// Bounds and centroid of one primitive, computed once before the build so the
+// split code never calls back into the (virtual) objects
+struct BVHPrimitiveInfo
+{
+	BVHPrimitiveInfo() {}
+	BVHPrimitiveInfo(size_t primitiveNumber, const Bounds3& bounds)
+		: primitiveNumber(primitiveNumber), bounds(bounds), centroid(0.5f * bounds.pMin + 0.5f * bounds.pMax)
+	{
+	}
+	size_t primitiveNumber;
+	Bounds3 bounds;
+	Vector3f centroid;
+};
+
+// One bin of the SAH sweep
+struct Bucket
+{
+	int count = 0;
+	Bounds3 bounds;
+};
+
+static constexpr int nBuckets = 16;
+// subtrees smaller than this are not worth a task of their own
+static constexpr int parallelBuildThreshold = 4096;
 
 BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod splitMethod)
-	: maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod), primitives(std::move(p))
+	: maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod), traversalCost(1.0f), primitives(std::move(p))
 {
-	time_t start, stop;
-	time(&start);
 	if (primitives.empty())
 		return;
 
-	root = recursiveBuild(primitives);
+	std::vector<Bounds3> primBounds(primitives.size());
+	for (size_t i = 0; i < primitives.size(); ++i)
+		primBounds[i] = primitives[i]->getBounds();
+	build(primBounds);
+
+	std::vector<Object*> orderedPrims(primitives.size());
+	for (size_t i = 0; i < primitiveOrder.size(); ++i)
+		orderedPrims[i] = primitives[primitiveOrder[i]];
+	primitives.swap(orderedPrims);
+}
+
+BVHAccel::BVHAccel(const std::vector<Bounds3>& primBounds, int maxPrimsInNode, SplitMethod splitMethod, float traversalCost)
+	: maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(splitMethod), traversalCost(traversalCost)
+{
+	if (primBounds.empty())
+		return;
+
+	build(primBounds);
+}
+
+BVHAccel::BVHAccel(ArrayView<LinearBVHNode> nodes, int maxPrimsInNode)
+	: maxPrimsInNode(std::min(255, maxPrimsInNode)), splitMethod(SplitMethod::SAH), traversalCost(1.0f), nodes(nodes)
+{
+}
+
+BVHAccel::~BVHAccel()
+{
+}
+
+void BVHAccel::build(const std::vector<Bounds3>& primBounds)
+{
+	time_t start, stop;
+	time(&start);
+
+	std::vector<BVHPrimitiveInfo> primitiveInfo(primBounds.size());
+	for (size_t i = 0; i < primBounds.size(); ++i)
+		primitiveInfo[i] = BVHPrimitiveInfo(i, primBounds[i]);
+
+	// Build subtrees concurrently for the first few levels, one level per doubling of cores
+	int parallelDepth = 0;
+	for (unsigned int n = std::thread::hardware_concurrency(); n > 1; n >>= 1)
+		++parallelDepth;
+	BVHBuildNode* root = recursiveBuild(primitiveInfo, 0, primitiveInfo.size(), parallelDepth);
+
+	// The build only permutes primitiveInfo, leaves reference ranges of it
+	primitiveOrder.resize(primitiveInfo.size());
+	for (size_t i = 0; i < primitiveInfo.size(); ++i)
+		primitiveOrder[i] = primitiveInfo[i].primitiveNumber;
+
+	// Flatten the tree into a depth-first array, the linked build nodes are no longer needed afterwards
+	nodeStorage.reserve(2 * primitiveInfo.size());
+	flattenBVHTree(root);
+	deleteBVHTree(root);
+	nodes = nodeStorage;
 
 	time(&stop);
 	double diff = difftime(stop, start);
@@ -22,101 +100,252 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode, SplitMethod split
 	printf("\rBVH Generation complete: \nTime Taken: %i hrs, %i mins, %i secs\n\n", hrs, mins, secs);
 }
 
-BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
+BVHBuildNode* BVHAccel::recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int parallelDepth)
 {
 	BVHBuildNode* node = new BVHBuildNode();
 
 	// Compute bounds of all primitives in BVH node
 	Bounds3 bounds;
-	for (int i = 0; i < objects.size(); ++i)
-		bounds = Union(bounds, objects[i]->getBounds());
-	if (objects.size() == 1) {
+	for (int i = start; i < end; ++i)
+		bounds = Union(bounds, primitiveInfo[i].bounds);
+	int nPrimitives = end - start;
+	if (nPrimitives == 1) {
 		// Create leaf _BVHBuildNode_
-		node->bounds = objects[0]->getBounds();
-		node->object = objects[0];
-		node->left = nullptr;
-		node->right = nullptr;
-		node->area = objects[0]->getArea();
+		node->initLeaf(start, nPrimitives, bounds);
 		return node;
 	}
-	else if (objects.size() == 2) {
-		node->left = recursiveBuild(std::vector{ objects[0] });
-		node->right = recursiveBuild(std::vector{ objects[1] });
 
-		node->bounds = Union(node->left->bounds, node->right->bounds);
-		node->area = node->left->area + node->right->area;
+	Bounds3 centroidBounds;
+	for (int i = start; i < end; ++i)
+		centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+	int dim = centroidBounds.maxExtent();
+	const Vector3f centroidExtent = centroidBounds.Diagonal();
+
+	// Partition primitives into two sets and build children
+	int mid = (start + end) / 2;
+	if ((splitMethod == SplitMethod::NAIVE || centroidExtent[dim] == 0) && nPrimitives <= maxPrimsInNode) {
+		node->initLeaf(start, nPrimitives, bounds);
 		return node;
 	}
+	if (centroidExtent[dim] == 0) {
+		// All centroids coincide, no split plane separates them: just halve the range
+	}
+	else if (splitMethod == SplitMethod::NAIVE) {
+		// Partition primitives into equally-sized subsets
+		std::nth_element(&primitiveInfo[start], &primitiveInfo[mid], &primitiveInfo[end - 1] + 1,
+			[dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+				return a.centroid[dim] < b.centroid[dim];
+			});
+	}
 	else {
-		Bounds3 centroidBounds;
-		for (int i = 0; i < objects.size(); ++i)
-			centroidBounds = Union(centroidBounds, objects[i]->getBounds().Centroid());
-		int dim = centroidBounds.maxExtent();
-		switch (dim) {
-		case 0:
-			std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-				return f1->getBounds().Centroid().x < f2->getBounds().Centroid().x;
-				});
-			break;
-		case 1:
-			std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-				return f1->getBounds().Centroid().y < f2->getBounds().Centroid().y;
-				});
-			break;
-		case 2:
-			std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-				return f1->getBounds().Centroid().z < f2->getBounds().Centroid().z;
-				});
-			break;
+		// Partition primitives using approximate SAH
+		Bucket buckets[nBuckets];
+		auto bucketOf = [&](const BVHPrimitiveInfo& pi) {
+			const Vector3f offset = centroidBounds.Offset(pi.centroid);
+			return std::min(nBuckets - 1, (int)(nBuckets * offset[dim]));
+		};
+		for (int i = start; i < end; ++i) {
+			int b = bucketOf(primitiveInfo[i]);
+			buckets[b].count++;
+			buckets[b].bounds = Union(buckets[b].bounds, primitiveInfo[i].bounds);
 		}
 
-		auto beginning = objects.begin();
-		auto middling = objects.begin() + (objects.size() / 2);
-		auto ending = objects.end();
-
-		auto leftshapes = std::vector<Object*>(beginning, middling);
-		auto rightshapes = std::vector<Object*>(middling, ending);
+		// Sweep the buckets from both sides to get the cost of splitting after each one
+		float cost[nBuckets - 1];
+		Bounds3 b0;
+		int count0 = 0;
+		for (int i = 0; i < nBuckets - 1; ++i) {
+			b0 = Union(b0, buckets[i].bounds);
+			count0 += buckets[i].count;
+			cost[i] = count0 > 0 ? count0 * b0.SurfaceArea() : 0;
+		}
+		Bounds3 b1;
+		int count1 = 0;
+		for (int i = nBuckets - 1; i > 0; --i) {
+			b1 = Union(b1, buckets[i].bounds);
+			count1 += buckets[i].count;
+			cost[i - 1] += count1 > 0 ? count1 * b1.SurfaceArea() : 0;
+		}
 
-		assert(objects.size() == (leftshapes.size() + rightshapes.size()));
+		int minCostSplitBucket = 0;
+		for (int i = 1; i < nBuckets - 1; ++i) {
+			if (cost[i] < cost[minCostSplitBucket])
+				minCostSplitBucket = i;
+		}
+		float minCost = traversalCost + cost[minCostSplitBucket] / bounds.SurfaceArea();
 
-		node->left = recursiveBuild(leftshapes);
-		node->right = recursiveBuild(rightshapes);
+		// Either create leaf or split primitives at selected SAH bucket. Leaves never hold
+		// more than maxPrimsInNode primitives, larger ranges are split even when no split pays off.
+		float leafCost = nPrimitives;
+		if (nPrimitives <= maxPrimsInNode && minCost >= leafCost) {
+			node->initLeaf(start, nPrimitives, bounds);
+			return node;
+		}
+		BVHPrimitiveInfo* pmid = std::partition(&primitiveInfo[start], &primitiveInfo[end - 1] + 1,
+			[&](const BVHPrimitiveInfo& pi) {
+				return bucketOf(pi) <= minCostSplitBucket;
+			});
+		mid = pmid - &primitiveInfo[0];
+	}
 
-		node->bounds = Union(node->left->bounds, node->right->bounds);
-		node->area = node->left->area + node->right->area;
+	BVHBuildNode* left;
+	BVHBuildNode* right;
+	if (parallelDepth > 0 && nPrimitives >= parallelBuildThreshold) {
+		auto leftTask = std::async(std::launch::async, [&]() {
+			return recursiveBuild(primitiveInfo, start, mid, parallelDepth - 1);
+			});
+		right = recursiveBuild(primitiveInfo, mid, end, parallelDepth - 1);
+		left = leftTask.get();
+	}
+	else {
+		left = recursiveBuild(primitiveInfo, start, mid, 0);
+		right = recursiveBuild(primitiveInfo, mid, end, 0);
 	}
+	node->initInterior(dim, left, right);
 
 	return node;
 }
 
-Intersection BVHAccel::Intersect(const Ray& ray) const
+int BVHAccel::flattenBVHTree(BVHBuildNode* node)
 {
-	Intersection isect;
-	if (!root)
-		return isect;
-	isect = BVHAccel::getIntersection(root, ray);
-	return isect;
+	int myOffset = nodeStorage.size();
+	nodeStorage.emplace_back();
+	nodeStorage[myOffset].bounds = node->bounds;
+	if (node->nPrimitives > 0) {
+		nodeStorage[myOffset].primitivesOffset = node->firstPrimOffset;
+		nodeStorage[myOffset].nPrimitives = node->nPrimitives;
+	}
+	else {
+		// Create interior flattened BVH node
+		nodeStorage[myOffset].axis = node->splitAxis;
+		nodeStorage[myOffset].nPrimitives = 0;
+		flattenBVHTree(node->left);
+		int secondChildOffset = flattenBVHTree(node->right);
+		nodeStorage[myOffset].secondChildOffset = secondChildOffset;
+	}
+	return myOffset;
 }
 
-Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
+void BVHAccel::deleteBVHTree(BVHBuildNode* node)
 {
-	// TODO Traverse the BVH to find intersection
+	if (!node)
+		return;
+	deleteBVHTree(node->left);
+	deleteBVHTree(node->right);
+	delete node;
+}
 
+void BVHAccel::Widen(int width)
+{
+	assert(width == 2 || width == 4 || width == 8);
+	wideNodes4.clear();
+	wideNodes8.clear();
+	this->width = width;
+	if (nodes.empty())
+		return;
+	if (width == 4)
+		collapse(wideNodes4, 0);
+	else if (width == 8)
+		collapse(wideNodes8, 0);
 }
 
+template <int N>
+int BVHAccel::collapse(std::vector<WideBVHNode<N> >& wideNodes, int nodeIndex) const
+{
+	int myOffset = wideNodes.size();
+	wideNodes.emplace_back();
 
-void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection& pos, float& pdf) {
-	if (node->left == nullptr || node->right == nullptr) {
-		node->object->Sample(pos, pdf);
-		pdf *= node->area;
-		return;
+	// Start from the binary node's children and keep opening the largest interior
+	// child until all N slots are used or only leaves are left
+	int children[N];
+	int nChildren = 0;
+	if (nodes[nodeIndex].nPrimitives > 0)
+		children[nChildren++] = nodeIndex;
+	else {
+		children[nChildren++] = nodeIndex + 1;
+		children[nChildren++] = nodes[nodeIndex].secondChildOffset;
+	}
+	while (nChildren < N) {
+		int largest = -1;
+		for (int i = 0; i < nChildren; ++i) {
+			const LinearBVHNode& child = nodes[children[i]];
+			if (child.nPrimitives == 0 && (largest < 0 || child.bounds.SurfaceArea() > nodes[children[largest]].bounds.SurfaceArea()))
+				largest = i;
+		}
+		if (largest < 0)
+			break;
+		int opened = children[largest];
+		children[largest] = opened + 1;
+		children[nChildren++] = nodes[opened].secondChildOffset;
+	}
+
+	for (int i = 0; i < nChildren; ++i) {
+		const LinearBVHNode& child = nodes[children[i]];
+		int childOffset = child.nPrimitives > 0 ? ~children[i] : collapse(wideNodes, children[i]);
+		wideNodes[myOffset].setChild(i, child.bounds, childOffset);
 	}
-	if (p < node->left->area) getSample(node->left, p, pos, pdf);
-	else getSample(node->right, p - node->left->area, pos, pdf);
+	return myOffset;
+}
+
+Intersection BVHAccel::Intersect(const Ray& ray) const
+{
+	Intersection isect;
+	float tClosest = std::numeric_limits<float>::infinity();
+	Traverse(ray, tClosest, [&](const LinearBVHNode& leaf, float& tMax) {
+		for (int i = 0; i < leaf.nPrimitives; ++i) {
+			Intersection hit = primitives[leaf.primitivesOffset + i]->getIntersection(ray);
+			if (hit.happened && hit.distance < isect.distance) {
+				isect = hit;
+				tMax = hit.distance;
+			}
+		}
+		return false;
+		});
+	return isect;
 }
 
-void BVHAccel::Sample(Intersection& pos, float& pdf) {
-	float p = std::sqrt(get_random_float()) * root->area;
-	getSample(root, p, pos, pdf);
-	pdf /= root->area;
+void BVHAccel::Intersect(const RayPacket& packet, Intersection* hits) const
+{
+	float tClosest[RayPacket::size];
+	for (int i = 0; i < RayPacket::size; ++i)
+		tClosest[i] = hits[i].happened ? hits[i].distance : std::numeric_limits<float>::infinity();
+	TraversePacket(packet, packet.active, tClosest, [&](const LinearBVHNode& leaf, int laneMask, float* tMax) {
+		for (int i = 0; i < leaf.nPrimitives; ++i)
+			primitives[leaf.primitivesOffset + i]->getIntersections(packet, laneMask, hits);
+		for (int lane = 0; lane < RayPacket::size; ++lane) {
+			if (hits[lane].happened)
+				tMax[lane] = std::min(tMax[lane], (float)hits[lane].distance);
+		}
+		});
+}
+
+bool BVHAccel::IntersectP(const Ray& ray) const
+{
+	bool occluded = false;
+	float tMax = ray.maxDistance();
+	Traverse(ray, tMax, [&](const LinearBVHNode& leaf, float&) {
+		for (int i = 0; i < leaf.nPrimitives && !occluded; ++i)
+			occluded = primitives[leaf.primitivesOffset + i]->intersect(ray);
+		return occluded;
+		});
+	return occluded;
+}
+
+int BVHAccel::IntersectP(const RayPacket& packet) const
+{
+	float tMax[RayPacket::size];
+	for (int i = 0; i < RayPacket::size; ++i)
+		tMax[i] = packet.rays[i] ? packet.rays[i]->maxDistance() : 0.0f;
+
+	int occluded = 0;
+	TraversePacket(packet, packet.active, tMax, [&](const LinearBVHNode& leaf, int laneMask, float* tMax) {
+		for (int i = 0; i < leaf.nPrimitives && (laneMask & ~occluded); ++i)
+			occluded |= primitives[leaf.primitivesOffset + i]->intersect(packet, laneMask & ~occluded);
+		// occluded lanes are done, a negative tMax keeps them out of every box
+		for (int lane = 0; lane < RayPacket::size; ++lane) {
+			if (occluded & (1 << lane))
+				tMax[lane] = -1.0f;
+		}
+		});
+	return occluded;
 }
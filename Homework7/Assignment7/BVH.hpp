@@ -10,6 +10,8 @@
 #include "Bounds3.hpp"
 #include "Intersection.hpp"
 #include "Vector.hpp"
+#include "WideBVH.hpp"
+#include "RayPacket.hpp"
 
 #include <atomic>
 #include <vector>
@@ -17,6 +19,24 @@
 #include <ctime>
 
 struct BVHBuildNode;
+
+// Node of the flattened tree. Nodes are stored in depth-first order, so the first
+// child of an interior node directly follows it and only the second child needs
+// an offset; a leaf points at its range of primitives instead.
+struct alignas(32) LinearBVHNode
+{
+	Bounds3 bounds;
+	union
+	{
+		int primitivesOffset;  // leaf
+		int secondChildOffset; // interior
+	};
+	uint16_t nPrimitives;      // 0 -> interior node
+	uint8_t axis;              // interior node: xyz
+	uint8_t pad[1];            // ensure 32 byte total size
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should fill half a cache line");
+
 // BVHAccel Forward Declarations
 struct BVHPrimitiveInfo;
 
@@ -30,24 +50,61 @@ public:
 
 	// BVHAccel Public Methods
 	BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
+	// Build over bare primitive bounds, for owners that test their primitives themselves
+	// (see MeshTriangle). Leaves then index primitiveOrder instead of primitives.
+	// traversalCost is the SAH cost of a node visit relative to one primitive test.
+	BVHAccel(const std::vector<Bounds3>& primBounds, int maxPrimsInNode, SplitMethod splitMethod, float traversalCost = 1.0f);
+	// Use a tree built before, e.g. read from a mesh cache. The nodes are not copied and
+	// have to outlive the BVHAccel.
+	BVHAccel(ArrayView<LinearBVHNode> nodes, int maxPrimsInNode);
 	Bounds3 WorldBound() const;
 	~BVHAccel();
 
 	Intersection Intersect(const Ray& ray) const;
-	Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
+	// Closest hits of all active lanes; hits[i] is only replaced by a closer hit
+	void Intersect(const RayPacket& packet, Intersection* hits) const;
+	// Occlusion queries: any primitive hit before ray.t_max, stopping at the first one.
+	// The packet version returns the mask of the occluded lanes.
 	bool IntersectP(const Ray& ray) const;
-	BVHBuildNode* root;
+	int IntersectP(const RayPacket& packet) const;
+
+	// Collapse the binary tree into 4- or 8-ary nodes that Traverse then walks instead;
+	// a width of 2 goes back to the binary nodes. Leaves are shared by both layouts.
+	void Widen(int width);
+	int Width() const { return width; }
+
+	// Walk the nodes front to back, calling intersectLeaf(leaf, tMax) on every leaf the ray
+	// reaches before tMax. The callback shrinks tMax on a closer hit and returns true to stop.
+	template <typename IntersectLeaf>
+	void Traverse(const Ray& ray, float& tMax, IntersectLeaf intersectLeaf) const;
+
+	// Packet version of Traverse over the binary nodes: every node is fetched once for all
+	// lanes of mask still inside it, and intersectLeaf(leaf, laneMask, tMax) gets those lanes.
+	template <typename IntersectLeaf>
+	void TraversePacket(const RayPacket& packet, int mask, float* tMax, IntersectLeaf intersectLeaf) const;
 
 	// BVHAccel Private Methods
-	BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+	template <int N, typename IntersectLeaf>
+	void TraverseWide(const std::vector<WideBVHNode<N> >& wideNodes, const Ray& ray, float& tMax, IntersectLeaf intersectLeaf) const;
+	template <int N>
+	int collapse(std::vector<WideBVHNode<N> >& wideNodes, int nodeIndex) const;
+	void build(const std::vector<Bounds3>& primBounds);
+	BVHBuildNode* recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end, int parallelDepth);
+	int flattenBVHTree(BVHBuildNode* node);
+	void deleteBVHTree(BVHBuildNode* node);
 
 	// BVHAccel Private Data
 	const int maxPrimsInNode;
 	const SplitMethod splitMethod;
+	const float traversalCost;
 	std::vector<Object*> primitives;
-
-	void getSample(BVHBuildNode* node, float p, Intersection& pos, float& pdf);
-	void Sample(Intersection& pos, float& pdf);
+	std::vector<int> primitiveOrder;
+	// nodes refers to nodeStorage after a build, or to the array given
+	ArrayView<LinearBVHNode> nodes;
+	std::vector<LinearBVHNode> nodeStorage;
+	int width = 2;
+	std::vector<WideBVHNode<4> > wideNodes4;
+	std::vector<WideBVHNode<8> > wideNodes8;
 };
 
 struct BVHBuildNode
@@ -55,8 +112,6 @@ struct BVHBuildNode
 	Bounds3 bounds;
 	BVHBuildNode* left;
 	BVHBuildNode* right;
-	Object* object;
-	float area;
 
 public:
 	int splitAxis = 0, firstPrimOffset = 0, nPrimitives = 0;
@@ -65,8 +120,148 @@ public:
 	{
 		bounds = Bounds3();
 		left = nullptr;right = nullptr;
-		object = nullptr;
+	}
+	void initLeaf(int first, int n, const Bounds3& b)
+	{
+		firstPrimOffset = first;
+		nPrimitives = n;
+		bounds = b;
+	}
+	void initInterior(int axis, BVHBuildNode* c0, BVHBuildNode* c1)
+	{
+		left = c0;
+		right = c1;
+		bounds = Union(c0->bounds, c1->bounds);
+		splitAxis = axis;
+		nPrimitives = 0;
 	}
 };
 
+template <typename IntersectLeaf>
+inline void BVHAccel::Traverse(const Ray& ray, float& tMax, IntersectLeaf intersectLeaf) const
+{
+	if (nodes.empty())
+		return;
+	if (width == 4)
+		return TraverseWide(wideNodes4, ray, tMax, intersectLeaf);
+	if (width == 8)
+		return TraverseWide(wideNodes8, ray, tMax, intersectLeaf);
+
+	std::array<int, 3> dirIsNeg = { ray.direction.x < 0, ray.direction.y < 0, ray.direction.z < 0 };
+	// Follow ray through BVH nodes to find primitive intersections
+	int toVisitOffset = 0, currentNodeIndex = 0;
+	int nodesToVisit[64];
+	while (true) {
+		const LinearBVHNode* node = &nodes[currentNodeIndex];
+		if (node->bounds.IntersectP(ray, ray.direction_inv, dirIsNeg, tMax)) {
+			if (node->nPrimitives > 0) {
+				if (intersectLeaf(*node, tMax))
+					break;
+				if (toVisitOffset == 0)
+					break;
+				currentNodeIndex = nodesToVisit[--toVisitOffset];
+			}
+			else {
+				// Visit the child on the near side of the split first, the far one is
+				// likely culled by tMax when it is popped
+				if (dirIsNeg[node->axis]) {
+					nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+					currentNodeIndex = node->secondChildOffset;
+				}
+				else {
+					nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+					currentNodeIndex = currentNodeIndex + 1;
+				}
+			}
+		}
+		else {
+			if (toVisitOffset == 0)
+				break;
+			currentNodeIndex = nodesToVisit[--toVisitOffset];
+		}
+	}
+}
+
+template <typename IntersectLeaf>
+inline void BVHAccel::TraversePacket(const RayPacket& packet, int mask, float* tMax, IntersectLeaf intersectLeaf) const
+{
+	if (nodes.empty() || mask == 0)
+		return;
+
+	// Each entry keeps the lanes that reached its parent, lanes leave the packet as
+	// they miss boxes and come back only for the siblings they did enter
+	struct StackEntry
+	{
+		int node;
+		int mask;
+	};
+	StackEntry toVisit[64];
+	int toVisitOffset = 0;
+	toVisit[toVisitOffset++] = { 0, mask };
+	while (toVisitOffset > 0) {
+		StackEntry entry = toVisit[--toVisitOffset];
+		const LinearBVHNode* node = &nodes[entry.node];
+		int laneMask = ::IntersectP(node->bounds, packet, tMax, entry.mask);
+		if (laneMask == 0)
+			continue;
+		if (node->nPrimitives > 0) {
+			intersectLeaf(*node, laneMask, tMax);
+			continue;
+		}
+		// Child order follows the packet's first ray, coherent rays agree on it
+		if (packet.dirIsNeg[node->axis]) {
+			toVisit[toVisitOffset++] = { entry.node + 1, laneMask };
+			toVisit[toVisitOffset++] = { node->secondChildOffset, laneMask };
+		}
+		else {
+			toVisit[toVisitOffset++] = { node->secondChildOffset, laneMask };
+			toVisit[toVisitOffset++] = { entry.node + 1, laneMask };
+		}
+	}
+}
+
+template <int N, typename IntersectLeaf>
+inline void BVHAccel::TraverseWide(const std::vector<WideBVHNode<N> >& wideNodes, const Ray& ray, float& tMax, IntersectLeaf intersectLeaf) const
+{
+	std::array<int, 3> dirIsNeg = { ray.direction.x < 0, ray.direction.y < 0, ray.direction.z < 0 };
+	// Every entry remembers its entry distance, so nodes pushed before a closer hit
+	// was found are dropped when popped
+	struct StackEntry
+	{
+		int child;
+		float tNear;
+	};
+	StackEntry toVisit[64 * N];
+	int toVisitOffset = 0;
+	toVisit[toVisitOffset++] = { 0, 0.0f };
+	while (toVisitOffset > 0) {
+		StackEntry entry = toVisit[--toVisitOffset];
+		if (entry.tNear > tMax)
+			continue;
+		if (entry.child < 0) {
+			if (intersectLeaf(nodes[~entry.child], tMax))
+				break;
+			continue;
+		}
+
+		const WideBVHNode<N>& node = wideNodes[entry.child];
+		alignas(32) float tNear[N];
+		int mask = IntersectChildren(node, ray, dirIsNeg, tMax, tNear);
+		if (mask == 0)
+			continue;
+
+		// Push the children hit far to near, so the nearest one is popped next
+		int first = toVisitOffset;
+		for (int i = 0; i < N; ++i) {
+			if (!(mask & (1 << i)))
+				continue;
+			StackEntry child = { node.child[i], tNear[i] };
+			int j = toVisitOffset++;
+			for (; j > first && toVisit[j - 1].tNear < child.tNear; --j)
+				toVisit[j] = toVisit[j - 1];
+			toVisit[j] = child;
+		}
+	}
+}
+
 #endif //RAYTRACING_BVH_H
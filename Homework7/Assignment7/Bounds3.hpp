@@ -50,7 +50,7 @@ public:
 		return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
 	}
 
-	Vector3f Centroid() { return 0.5 * pMin + 0.5 * pMax; }
+	Vector3f Centroid() const { return 0.5 * pMin + 0.5 * pMax; }
 	Bounds3 Intersect(const Bounds3& b)
 	{
 		return Bounds3(Vector3f(fmax(pMin.x, b.pMin.x), fmax(pMin.y, b.pMin.y), fmax(pMin.z, b.pMin.z)),
@@ -86,17 +86,60 @@ public:
 		return (i == 0) ? pMin : pMax;
 	}
 
-	inline bool IntersectP(const Ray& ray, const Vector3f& invDir, const std::array<int, 3>& dirisNeg) const;
+	// tMax: the box is rejected if the ray only enters it after tMax (e.g. behind the closest hit so far)
+	inline bool IntersectP(const Ray& ray, const Vector3f& invDir, const std::array<int, 3>& dirisNeg,
+		float tMax = std::numeric_limits<float>::infinity()) const;
 };
 
 
 
-inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir, const std::array<int, 3>& dirIsNeg) const
+inline bool Bounds3::IntersectP(const Ray& ray, const Vector3f& invDir, const std::array<int, 3>& dirIsNeg, float tMax) const
 {
 	// invDir: ray direction(x,y,z), invDir=(1.0/x,1.0/y,1.0/z), use this because Multiply is faster that Division
 	// dirIsNeg: ray direction(x,y,z), dirIsNeg=[int(x>0),int(y>0),int(z>0)], use this to simplify your logic
 	// TODO test if ray bound intersects
+	float min_x_time = (pMin.x - ray.origin.x) * invDir.x;
+	float max_x_time = (pMax.x - ray.origin.x) * invDir.x;
+	if (dirIsNeg[0])
+	{
+		float temp = min_x_time;
+		min_x_time = max_x_time;
+		max_x_time = temp;
+	}
+
+	float min_y_time = (pMin.y - ray.origin.y) * invDir.y;
+	float max_y_time = (pMax.y - ray.origin.y) * invDir.y;
+	if (dirIsNeg[1])
+	{
+		float temp = min_y_time;
+		min_y_time = max_y_time;
+		max_y_time = temp;
+	}
+
+	float max_z_time = (pMax.z - ray.origin.z) * invDir.z;
+	float min_z_time = (pMin.z - ray.origin.z) * invDir.z;
+	if (dirIsNeg[2])
+	{
+		float temp = min_z_time;
+		min_z_time = max_z_time;
+		max_z_time = temp;
+	}
 
+	float enter_time = min_x_time;
+	if (enter_time < min_y_time)
+		enter_time = min_y_time;
+	if (enter_time < min_z_time)
+		enter_time = min_z_time;
+
+	float leave_time = max_x_time;
+	if (leave_time > max_y_time)
+		leave_time = max_y_time;
+	if (leave_time > max_z_time)
+		leave_time = max_z_time;
+
+	if (leave_time >= 0 && enter_time <= leave_time && enter_time <= tMax)
+		return true;
+	return false;
 }
 
 inline Bounds3 Union(const Bounds3& b1, const Bounds3& b2)
@@ -21,6 +21,7 @@ struct Intersection
 		distance = std::numeric_limits<double>::max();
 		obj = nullptr;
 		m = nullptr;
+		index = 0;
 	}
 	bool happened;
 	Vector3f coords;
@@ -30,6 +31,8 @@ struct Intersection
 	double distance;
 	Object* obj;
 	Material* m;
+	// part of obj that was hit, numbered as its emitters (see Object::getEmitterCount)
+	uint32_t index;
 };
 
 #endif //RAYTRACING_INTERSECTION_H
@@ -0,0 +1,185 @@
+#include "LightSampler.hpp"
+
+#include <algorithm>
+
+void LightSampler::build(const std::vector<Object*>& objects, bool buildLightBVH)
+{
+	emitters.clear();
+	lightNodes.clear();
+	emitterLeaf.clear();
+	firstPart.clear();
+	partEmitter.clear();
+	totalArea = 0;
+	for (Object* object : objects) {
+		if (!object->hasEmit())
+			continue;
+		firstPart[object] = partEmitter.size();
+		for (uint32_t i = 0; i < object->getEmitterCount(); ++i) {
+			float area = object->getEmitterArea(i);
+			if (area > 0) {
+				partEmitter.push_back(emitters.size());
+				emitters.push_back({ object, i, area });
+				totalArea += area;
+			}
+			else
+				partEmitter.push_back(-1);
+		}
+	}
+	if (emitters.empty())
+		return;
+
+	// Split the bins into those below and above the average, then let every small bin
+	// take the rest of its probability from a large one. In double, as a few large lights
+	// are drained by thousands of small triangles and float would drift by a whole bin.
+	size_t n = emitters.size();
+	aliasProb.assign(n, 1.0f);
+	alias.resize(n);
+	std::vector<double> scaled(n);
+	std::vector<uint32_t> small, large;
+	for (size_t i = 0; i < n; ++i) {
+		alias[i] = i;
+		scaled[i] = (double)emitters[i].area / totalArea * n;
+		(scaled[i] < 1.0 ? small : large).push_back(i);
+	}
+	while (!small.empty() && !large.empty()) {
+		uint32_t s = small.back(), l = large.back();
+		small.pop_back();
+		aliasProb[s] = scaled[s];
+		alias[s] = l;
+		scaled[l] -= 1.0 - scaled[s];
+		if (scaled[l] < 1.0) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+	// what remains is 1 up to rounding
+
+	if (!buildLightBVH)
+		return;
+	std::vector<Bounds3> bounds(n);
+	std::vector<float> power(n);
+	std::vector<uint32_t> ids(n);
+	for (size_t i = 0; i < n; ++i) {
+		const Emitter& e = emitters[i];
+		Vector3f emission = e.object->getEmission();
+		bounds[i] = e.object->getEmitterBounds(e.index);
+		power[i] = e.area * (emission.x + emission.y + emission.z) / 3;
+		ids[i] = i;
+	}
+	lightNodes.reserve(2 * n);
+	emitterLeaf.resize(n);
+	buildLightNodes(ids, 0, n, -1, bounds, power);
+}
+
+int LightSampler::buildLightNodes(std::vector<uint32_t>& ids, int begin, int end, int parent, const std::vector<Bounds3>& bounds, const std::vector<float>& power)
+{
+	int nodeIndex = lightNodes.size();
+	lightNodes.emplace_back();
+	LightNode node;
+	node.power = 0;
+	node.secondChild = -1;
+	node.parent = parent;
+	node.emitter = -1;
+	Bounds3 centroidBounds;
+	for (int i = begin; i < end; ++i) {
+		node.bounds = Union(node.bounds, bounds[ids[i]]);
+		centroidBounds = Union(centroidBounds, bounds[ids[i]].Centroid());
+		node.power += power[ids[i]];
+	}
+
+	if (end - begin == 1) {
+		node.emitter = ids[begin];
+		emitterLeaf[ids[begin]] = nodeIndex;
+	}
+	else {
+		// median split along the widest axis of the centroids
+		int axis = centroidBounds.maxExtent();
+		int mid = (begin + end) / 2;
+		auto key = [&](uint32_t i) {
+			const Vector3f centroid = bounds[i].Centroid();
+			return centroid[axis];
+		};
+		std::nth_element(ids.begin() + begin, ids.begin() + mid, ids.begin() + end, [&](uint32_t a, uint32_t b) { return key(a) < key(b); });
+		buildLightNodes(ids, begin, mid, nodeIndex, bounds, power);
+		node.secondChild = buildLightNodes(ids, mid, end, nodeIndex, bounds, power);
+	}
+	lightNodes[nodeIndex] = node;
+	return nodeIndex;
+}
+
+// probability of taking the left child of an interior node, seen from p
+float LightSampler::leftProbability(const LightNode& node, int nodeIndex, const Vector3f& p) const
+{
+	float importanceLeft = importance(lightNodes[nodeIndex + 1], p), importanceRight = importance(lightNodes[node.secondChild], p);
+	float sum = importanceLeft + importanceRight;
+	return sum > 0 ? importanceLeft / sum : 0.5f;
+}
+
+float LightSampler::importance(const LightNode& node, const Vector3f& p) const
+{
+	// power over the squared distance to the center of the node, no closer than its radius
+	Vector3f center = node.bounds.Centroid();
+	float radius2 = dotProduct(node.bounds.Diagonal(), node.bounds.Diagonal()) * 0.25f;
+	float distance2 = dotProduct(center - p, center - p);
+	return node.power / std::max(distance2, std::max(radius2, 1e-6f));
+}
+
+void LightSampler::Sample(const Vector3f& p, Intersection& pos, float& pdf) const
+{
+	if (emitters.empty()) {
+		pdf = 0;
+		return;
+	}
+
+	if (lightNodes.empty()) {
+		// a random number of its own for the coin, the fraction of get_random_float() * n
+		// is too coarse for the tiny probabilities of small triangles next to big lights
+		uint32_t bin = std::min<uint32_t>(get_random_float() * emitters.size(), emitters.size() - 1);
+		const Emitter& e = emitters[get_random_float() < aliasProb[bin] ? bin : alias[bin]];
+		e.object->SampleEmitter(e.index, pos);
+		pdf = 1.0f / totalArea;
+		return;
+	}
+
+	// A random number per level rather than one rescaled at every node, which would run
+	// out of bits in the deep trees of large meshes
+	float pick = 1;
+	int nodeIndex = 0;
+	while (lightNodes[nodeIndex].emitter < 0) {
+		const LightNode& node = lightNodes[nodeIndex];
+		float pLeft = leftProbability(node, nodeIndex, p);
+		if (get_random_float() < pLeft) {
+			pick *= pLeft;
+			nodeIndex = nodeIndex + 1;
+		}
+		else {
+			pick *= 1 - pLeft;
+			nodeIndex = node.secondChild;
+		}
+	}
+	const Emitter& e = emitters[lightNodes[nodeIndex].emitter];
+	e.object->SampleEmitter(e.index, pos);
+	pdf = pick / e.area;
+}
+
+float LightSampler::Pdf(const Vector3f& p, const Intersection& light) const
+{
+	auto first = firstPart.find(light.obj);
+	if (first == firstPart.end() || first->second + light.index >= partEmitter.size())
+		return 0;
+	int emitter = partEmitter[first->second + light.index];
+	if (emitter < 0)
+		return 0;
+	if (lightNodes.empty())
+		return 1.0f / totalArea;
+
+	// the probabilities of the way down to the leaf, collected on the way up
+	float pick = 1;
+	int child = emitterLeaf[emitter];
+	for (int nodeIndex = lightNodes[child].parent; nodeIndex >= 0; nodeIndex = lightNodes[nodeIndex].parent) {
+		float pLeft = leftProbability(lightNodes[nodeIndex], nodeIndex, p);
+		pick *= child == nodeIndex + 1 ? pLeft : 1 - pLeft;
+		child = nodeIndex;
+	}
+	return pick / emitters[emitter].area;
+}
@@ -0,0 +1,64 @@
+//
+// Table of the emissive parts of a scene (see Object::getEmitterCount) for next event
+// estimation, built once with the scene BVH.
+//
+
+#pragma once
+
+#include "Object.hpp"
+
+#include <unordered_map>
+#include <vector>
+
+// Lights are picked by area with an alias table, which takes O(1) whatever their number.
+// With the light BVH they are picked instead by an estimate of what they contribute to the
+// shading point, their power over the squared distance, walking down the tree with the
+// probability of each child in proportion to that estimate. That puts most samples on the
+// nearby lights of scenes with many of them.
+class LightSampler
+{
+public:
+	void build(const std::vector<Object*>& objects, bool buildLightBVH);
+	bool empty() const { return emitters.empty(); }
+
+	// Point pos on a light, its pdf with respect to area. Only the light BVH looks at p.
+	void Sample(const Vector3f& p, Intersection& pos, float& pdf) const;
+	// The pdf Sample(p, ...) has of drawing the point of light, a hit on an emitter
+	float Pdf(const Vector3f& p, const Intersection& light) const;
+
+	float totalArea = 0;
+
+private:
+	struct Emitter
+	{
+		Object* object;
+		uint32_t index;
+		float area;
+	};
+
+	// Interior nodes are followed by their first child; a leaf holds one emitter
+	struct LightNode
+	{
+		Bounds3 bounds;
+		float power;
+		int secondChild;
+		int parent; // -1 for the root
+		int emitter; // -1 for interior nodes
+	};
+
+	int buildLightNodes(std::vector<uint32_t>& ids, int begin, int end, int parent, const std::vector<Bounds3>& bounds, const std::vector<float>& power);
+	float importance(const LightNode& node, const Vector3f& p) const;
+	float leftProbability(const LightNode& node, int nodeIndex, const Vector3f& p) const;
+
+	std::vector<Emitter> emitters;
+	// Vose alias table: bin i keeps emitter i with probability aliasProb[i] and gives the
+	// rest to emitter alias[i]
+	std::vector<float> aliasProb;
+	std::vector<uint32_t> alias;
+	std::vector<LightNode> lightNodes;
+	// leaf of every emitter, and where the emitters of an object start in partEmitter,
+	// which holds the emitter of each of its parts or -1 for those of no area
+	std::vector<int> emitterLeaf;
+	std::unordered_map<const Object*, uint32_t> firstPart;
+	std::vector<int> partEmitter;
+};
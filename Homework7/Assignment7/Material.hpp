@@ -7,7 +7,11 @@
 
 #include "Vector.hpp"
 
-enum MaterialType { DIFFUSE };
+// DIFFUSE: Lambertian with albedo Kd.
+// MICROFACET: Kd under a GGX specular layer with Schlick Fresnel of normal reflectance Ks
+// and roughness in (0, 1], alpha = roughness^2. The diffuse base only gets the light the
+// layer lets through, on the way in and on the way out.
+enum MaterialType { DIFFUSE, MICROFACET };
 
 class Material
 {
@@ -72,9 +76,9 @@ private:
 		// kt = 1 - kr;
 	}
 
-	Vector3f toWorld(const Vector3f& a, const Vector3f& N)
+	// Tangents B, C that make (B, C, N) an orthonormal frame
+	void frame(const Vector3f& N, Vector3f& B, Vector3f& C) const
 	{
-		Vector3f B, C;
 		if (std::fabs(N.x) > std::fabs(N.y)) {
 			float invLen = 1.0f / std::sqrt(N.x * N.x + N.z * N.z);
 			C = Vector3f(N.z * invLen, 0.0f, -N.x * invLen);
@@ -84,9 +88,74 @@ private:
 			C = Vector3f(0.0f, N.z * invLen, -N.y * invLen);
 		}
 		B = crossProduct(C, N);
+	}
+
+	Vector3f toWorld(const Vector3f& a, const Vector3f& N)
+	{
+		Vector3f B, C;
+		frame(N, B, C);
 		return a.x * B + a.y * C + a.z * N;
 	}
 
+	Vector3f toLocal(const Vector3f& a, const Vector3f& N)
+	{
+		Vector3f B, C;
+		frame(N, B, C);
+		return Vector3f(dotProduct(a, B), dotProduct(a, C), dotProduct(a, N));
+	}
+
+	// cosine weighted direction around N, pdf cos / PI
+	Vector3f sampleCosine(const Vector3f& N)
+	{
+		float x_1 = get_random_float(), x_2 = get_random_float();
+		float r = std::sqrt(x_1), phi = 2 * M_PI * x_2;
+		Vector3f localRay(r * std::cos(phi), r * std::sin(phi), std::sqrt(std::max(0.0f, 1.0f - x_1)));
+		return toWorld(localRay, N);
+	}
+
+	// GGX with alpha = roughness^2; cosines are with respect to the normal
+	float ggxAlpha() const { return std::max(roughness * roughness, 1e-3f); }
+	float ggxD(float cosH) const
+	{
+		float alpha2 = ggxAlpha() * ggxAlpha();
+		float d = cosH * cosH * (alpha2 - 1) + 1;
+		return alpha2 / (M_PI * d * d);
+	}
+	// Smith Lambda, G1 = 1 / (1 + Lambda)
+	float ggxLambda(float cosTheta) const
+	{
+		float alpha2 = ggxAlpha() * ggxAlpha();
+		float tan2 = std::max(0.0f, 1 - cosTheta * cosTheta) / (cosTheta * cosTheta);
+		return (std::sqrt(1 + alpha2 * tan2) - 1) / 2;
+	}
+	// Half vector of the normals visible from the local direction V (Heitz 2018), whose pdf
+	// is G1(V) * max(0, V.H) * D(H) / V.z
+	Vector3f sampleGGXVisibleNormal(const Vector3f& V)
+	{
+		float alpha = ggxAlpha();
+		Vector3f Vh = normalize(Vector3f(alpha * V.x, alpha * V.y, V.z));
+		float lensq = Vh.x * Vh.x + Vh.y * Vh.y;
+		Vector3f T1 = lensq > 0 ? Vector3f(-Vh.y, Vh.x, 0) / std::sqrt(lensq) : Vector3f(1, 0, 0);
+		Vector3f T2 = crossProduct(Vh, T1);
+		float r = std::sqrt(get_random_float()), phi = 2 * M_PI * get_random_float();
+		float t1 = r * std::cos(phi), t2 = r * std::sin(phi);
+		float s = 0.5f * (1 + Vh.z);
+		t2 = (1 - s) * std::sqrt(std::max(0.0f, 1 - t1 * t1)) + s * t2;
+		Vector3f Nh = t1 * T1 + t2 * T2 + std::sqrt(std::max(0.0f, 1 - t1 * t1 - t2 * t2)) * Vh;
+		return normalize(Vector3f(alpha * Nh.x, alpha * Nh.y, std::max(0.0f, Nh.z)));
+	}
+	// Schlick's approximation of the Fresnel reflectance at normal reflectance Ks
+	Vector3f fresnel(float cosTheta) const
+	{
+		return Ks + (Vector3f(1.0f) - Ks) * std::pow(1 - std::max(0.0f, cosTheta), 5.0f);
+	}
+	// probability of sampling the specular rather than the diffuse lobe
+	float specularWeight() const
+	{
+		float ks = Ks.x + Ks.y + Ks.z, kd = Kd.x + Kd.y + Kd.z;
+		return ks + kd > 0 ? ks / (ks + kd) : 1.0f;
+	}
+
 public:
 	MaterialType m_type;
 	//Vector3f m_color;
@@ -94,6 +163,7 @@ public:
 	float ior;
 	Vector3f Kd, Ks;
 	float specularExponent;
+	float roughness;
 	//Texture tex;
 
 	inline Material(MaterialType t = DIFFUSE, Vector3f e = Vector3f(0, 0, 0));
@@ -103,9 +173,11 @@ public:
 	inline Vector3f getEmission();
 	inline bool hasEmission();
 
-	// sample a ray by Material properties
+	// wi is the direction the ray came in along, pointing at the surface, wo the one it
+	// leaves in, away from it.
+	// sample a ray by Material properties, roughly in proportion to the BSDF times cosine
 	inline Vector3f sample(const Vector3f& wi, const Vector3f& N);
-	// given a ray, calculate the PdF of this ray
+	// given a ray, calculate the PdF of this ray, with respect to solid angle
 	inline float pdf(const Vector3f& wi, const Vector3f& wo, const Vector3f& N);
 	// given a ray, calculate the contribution of this ray
 	inline Vector3f eval(const Vector3f& wi, const Vector3f& wo, const Vector3f& N);
@@ -116,6 +188,7 @@ Material::Material(MaterialType t, Vector3f e)
 	m_type = t;
 	//m_color = c;
 	m_emission = e;
+	roughness = 0.5f;
 }
 
 MaterialType Material::getType() { return m_type; }
@@ -138,16 +211,26 @@ Vector3f Material::sample(const Vector3f& wi, const Vector3f& N)
 	switch (m_type) {
 	case DIFFUSE:
 	{
-		// uniform sample on the hemisphere
-		float x_1 = get_random_float(), x_2 = get_random_float();
-		float z = std::fabs(1.0f - 2.0f * x_1);
-		float r = std::sqrt(1.0f - z * z), phi = 2 * M_PI * x_2;
-		Vector3f localRay(r * std::cos(phi), r * std::sin(phi), z);
-		return toWorld(localRay, N);
-
+		// cosine weighted, so f * cos / pdf is just Kd
+		return sampleCosine(N);
 		break;
 	}
+	case MICROFACET:
+	{
+		if (get_random_float() >= specularWeight())
+			return sampleCosine(N);
+		// reflect about a normal visible from the viewer, none of the samples go to
+		// microfacets it cannot see
+		Vector3f V = toLocal(-wi, N);
+		if (V.z <= 0)
+			return sampleCosine(N);
+		Vector3f H = sampleGGXVisibleNormal(V);
+		Vector3f L = 2 * dotProduct(V, H) * H - V;
+		return toWorld(L, N);
+		break;
 	}
+	}
+	return Vector3f(0.0f);
 }
 
 float Material::pdf(const Vector3f& wi, const Vector3f& wo, const Vector3f& N)
@@ -155,14 +238,31 @@ float Material::pdf(const Vector3f& wi, const Vector3f& wo, const Vector3f& N)
 	switch (m_type) {
 	case DIFFUSE:
 	{
-		// uniform sample probability 1 / (2 * PI)
-		if (dotProduct(wo, N) > 0.0f)
-			return 0.5f / M_PI;
+		// cosine sample probability cos / PI
+		float cosalpha = dotProduct(wo, N);
+		if (cosalpha > 0.0f)
+			return cosalpha / M_PI;
 		else
 			return 0.0f;
 		break;
 	}
+	case MICROFACET:
+	{
+		float cosO = dotProduct(wo, N), cosI = dotProduct(-wi, N);
+		if (cosO <= 0.0f)
+			return 0.0f;
+		float ps = specularWeight();
+		float diffuse = cosO / M_PI;
+		if (cosI <= 0.0f)
+			return diffuse;
+		// D_V(H) / (4 V.H) = G1(V) * D(H) / (4 V.z)
+		Vector3f H = normalize(wo - wi);
+		float specular = ggxD(dotProduct(H, N)) / (1 + ggxLambda(cosI)) / (4 * cosI);
+		return ps * specular + (1 - ps) * diffuse;
+		break;
+	}
 	}
+	return 0.0f;
 }
 
 Vector3f Material::eval(const Vector3f& wi, const Vector3f& wo, const Vector3f& N)
@@ -180,7 +280,24 @@ Vector3f Material::eval(const Vector3f& wi, const Vector3f& wo, const Vector3f&
 			return Vector3f(0.0f);
 		break;
 	}
+	case MICROFACET:
+	{
+		float cosO = dotProduct(wo, N), cosI = dotProduct(-wi, N);
+		if (cosO <= 0.0f || cosI <= 0.0f)
+			return Vector3f(0.0f);
+		Vector3f H = normalize(wo - wi);
+		Vector3f F = fresnel(dotProduct(H, wo));
+		// height correlated Smith masking and shadowing
+		float G = 1 / (1 + ggxLambda(cosI) + ggxLambda(cosO));
+		Vector3f specular = F * (ggxD(dotProduct(H, N)) * G / (4 * cosI * cosO));
+		// what the layer does not reflect reaches the base, and leaves it the same way
+		Vector3f one(1.0f);
+		Vector3f diffuse = Kd / M_PI * (one - fresnel(cosI)) * (one - fresnel(cosO));
+		return diffuse + specular;
+		break;
+	}
 	}
+	return Vector3f(0.0f);
 }
 
 #endif //RAYTRACING_MATERIAL_H
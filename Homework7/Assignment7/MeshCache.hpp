@@ -0,0 +1,213 @@
+//
+// Binary cache of a triangle mesh and its BVH, written next to the .obj file it was
+// built from. The file is the in-memory layout itself: a header followed by the arrays,
+// each 32 byte aligned, in native byte order. Opening it maps the file and hands out
+// views into the mapping, nothing is parsed or copied.
+//
+
+#pragma once
+
+#include "BVH.hpp"
+#include "ObjLoader.hpp"
+#include "global.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+// Size and modification time of the source file; a cache written for other values is stale
+struct FileStamp
+{
+	uint64_t size = 0;
+	int64_t mtime = 0;
+
+	static bool Of(const std::string& filename, FileStamp& stamp)
+	{
+		std::error_code error;
+		stamp.size = std::filesystem::file_size(filename, error);
+		if (error)
+			return false;
+		stamp.mtime = std::filesystem::last_write_time(filename, error).time_since_epoch().count();
+		return !error;
+	}
+};
+
+class MeshCache
+{
+public:
+	// Bump on any change to the header or to what the sections hold
+	static constexpr uint32_t version = 2;
+
+	enum Section
+	{
+		VertexX, VertexY, VertexZ,
+		VertexIndex, AreaCdf,
+		V0X, V0Y, V0Z, E1X, E1Y, E1Z, E2X, E2Y, E2Z,
+		BVHNodes,
+		SectionCount
+	};
+
+	struct Header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t triangleCount;
+		FileStamp source;
+		// BVH build parameters, a cache built with other ones is rebuilt
+		int32_t maxPrimsInNode;
+		float traversalCost;
+		float area;
+		float boundsMin[3], boundsMax[3];
+		uint64_t offsets[SectionCount]; // from the start of the file
+		uint64_t sizes[SectionCount];   // in bytes
+	};
+
+	// Lay out the arrays in memory as they would be in the file; sections[s] is the data
+	// and byte size of Section s. The offsets and sizes of header are filled in here.
+	MeshCache(const Header& header, const std::pair<const void*, size_t> (&sections)[SectionCount])
+	{
+		Header h = header;
+		std::memcpy(h.magic, "MESHBVH", 8);
+		h.version = version;
+		uint64_t offset = align(sizeof(Header));
+		for (int s = 0; s < SectionCount; ++s) {
+			h.offsets[s] = offset;
+			h.sizes[s] = sections[s].second;
+			offset = align(offset + sections[s].second);
+		}
+
+		buffer.resize(offset / sizeof(Block));
+		char* p = reinterpret_cast<char*>(buffer.data());
+		std::memcpy(p, &h, sizeof(Header));
+		for (int s = 0; s < SectionCount; ++s) {
+			if (sections[s].second > 0)
+				std::memcpy(p + h.offsets[s], sections[s].first, sections[s].second);
+		}
+		base = p;
+		length = offset;
+	}
+
+	// Map the cache file path, null if it is missing, damaged, of another version, or was
+	// built from another source file or with other BVH parameters. Damaged covers sections
+	// out of the file or of the wrong size, vertex indices past the vertices and BVH nodes
+	// that point outside the nodes or triangles, so a cache that opens is safe to use.
+	static std::unique_ptr<MeshCache> Open(const std::string& path, const FileStamp& source, int maxPrimsInNode, float traversalCost)
+	{
+		std::unique_ptr<MeshCache> cache(new MeshCache());
+		cache->file.reset(new MappedFile(path));
+		if (!cache->file->isValid() || cache->file->size() < sizeof(Header))
+			return nullptr;
+		cache->base = cache->file->data();
+		cache->length = cache->file->size();
+
+		const Header& h = cache->header();
+		if (std::memcmp(h.magic, "MESHBVH", 8) != 0 || h.version != version
+			|| h.source.size != source.size || h.source.mtime != source.mtime
+			|| h.maxPrimsInNode != maxPrimsInNode || h.traversalCost != traversalCost)
+			return nullptr;
+		for (int s = 0; s < SectionCount; ++s) {
+			if (h.offsets[s] % sizeof(Block) != 0 || h.offsets[s] > cache->length || h.sizes[s] > cache->length - h.offsets[s])
+				return nullptr;
+		}
+
+		uint64_t triangleSize = uint64_t(h.triangleCount) * sizeof(float);
+		if (h.sizes[VertexIndex] != 3 * uint64_t(h.triangleCount) * sizeof(uint32_t) || h.sizes[AreaCdf] != triangleSize
+			|| h.sizes[VertexY] != h.sizes[VertexX] || h.sizes[VertexZ] != h.sizes[VertexX]
+			|| h.sizes[BVHNodes] % sizeof(LinearBVHNode) != 0)
+			return nullptr;
+		for (int s = V0X; s <= E2Z; ++s) {
+			if (h.sizes[s] != triangleSize)
+				return nullptr;
+		}
+		uint32_t vertexCount = h.sizes[VertexX] / sizeof(float);
+		for (uint32_t i : cache->get<uint32_t>(VertexIndex)) {
+			if (i >= vertexCount)
+				return nullptr;
+		}
+		if (!validTree(cache->get<LinearBVHNode>(BVHNodes), h.triangleCount))
+			return nullptr;
+		return cache;
+	}
+
+	// Write the cache to path, through a temporary file so readers never see half of it
+	bool Save(const std::string& path) const
+	{
+		std::string temporary = path + ".tmp";
+		FILE* fp = fopen(temporary.c_str(), "wb");
+		if (!fp)
+			return false;
+		bool written = fwrite(base, 1, length, fp) == length;
+		written &= fclose(fp) == 0;
+		std::error_code error;
+		if (written)
+			std::filesystem::rename(temporary, path, error);
+		if (!written || error) {
+			std::filesystem::remove(temporary, error);
+			return false;
+		}
+		return true;
+	}
+
+	const Header& header() const { return *reinterpret_cast<const Header*>(base); }
+
+	template <typename T>
+	ArrayView<T> get(Section s) const
+	{
+		const Header& h = header();
+		return ArrayView<T>(reinterpret_cast<const T*>(base + h.offsets[s]), h.sizes[s] / sizeof(T));
+	}
+
+private:
+	struct alignas(32) Block
+	{
+		char bytes[32];
+	};
+
+	MeshCache() = default;
+
+	// Every node is reached once from the root, no deeper than the traversal stacks of
+	// BVHAccel go, and every leaf lies within the triangles
+	static bool validTree(ArrayView<LinearBVHNode> nodes, uint32_t triangleCount)
+	{
+		if (nodes.empty())
+			return triangleCount == 0;
+		struct Entry
+		{
+			size_t node;
+			int depth;
+		};
+		std::vector<Entry> toVisit = { { 0, 1 } };
+		size_t visited = 0;
+		while (!toVisit.empty()) {
+			Entry entry = toVisit.back();
+			toVisit.pop_back();
+			if (++visited > nodes.size() || entry.depth > 64)
+				return false;
+			const LinearBVHNode& node = nodes[entry.node];
+			if (node.nPrimitives > 0) {
+				if (node.primitivesOffset < 0 || uint64_t(node.primitivesOffset) + node.nPrimitives > triangleCount)
+					return false;
+			}
+			else {
+				if (node.axis > 2 || node.secondChildOffset <= int64_t(entry.node) + 1 || size_t(node.secondChildOffset) >= nodes.size())
+					return false;
+				toVisit.push_back({ entry.node + 1, entry.depth + 1 });
+				toVisit.push_back({ size_t(node.secondChildOffset), entry.depth + 1 });
+			}
+		}
+		return visited == nodes.size();
+	}
+
+	static uint64_t align(uint64_t offset) { return (offset + sizeof(Block) - 1) / sizeof(Block) * sizeof(Block); }
+
+	// the cache lives in either the mapped file or buffer
+	std::unique_ptr<MappedFile> file;
+	std::vector<Block> buffer;
+	const char* base = nullptr;
+	size_t length = 0;
+};
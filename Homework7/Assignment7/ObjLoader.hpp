@@ -0,0 +1,306 @@
+//
+// Wavefront .obj loader: the file is mapped into memory, cut into chunks at line ends and
+// the chunks are parsed on separate threads with std::from_chars.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#if defined(_WIN32)
+#include <fstream>
+#include <iterator>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Triangle mesh from an .obj file, one array per coordinate. A vertex is a distinct
+// position / texture coordinate / normal index triple of the faces, so vertices shared by
+// faces are stored once. Polygons are split into triangle fans.
+struct ObjMesh
+{
+	std::vector<float> px, py, pz;
+	std::vector<float> nx, ny, nz; // empty if the faces have no normals
+	std::vector<float> u, v;       // empty if the faces have no texture coordinates
+	std::vector<uint32_t> indices; // three vertices per triangle
+
+	size_t vertexCount() const { return px.size(); }
+	size_t triangleCount() const { return indices.size() / 3; }
+};
+
+// Read-only view of a whole file, memory mapped where the platform allows it
+class MappedFile
+{
+public:
+	explicit MappedFile(const std::string& filename)
+	{
+#if defined(_WIN32)
+		std::ifstream file(filename, std::ios::binary);
+		if (!file)
+			return;
+		buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		ptr = buffer.data();
+		length = buffer.size();
+		valid = true;
+#else
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			return;
+		struct stat st;
+		if (fstat(fd, &st) == 0) {
+			length = st.st_size;
+			valid = true;
+			if (length > 0) {
+				void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (p == MAP_FAILED) {
+					valid = false;
+					length = 0;
+				}
+				else {
+					madvise(p, length, MADV_SEQUENTIAL);
+					ptr = static_cast<const char*>(p);
+				}
+			}
+		}
+		close(fd);
+#endif
+	}
+
+	~MappedFile()
+	{
+#if !defined(_WIN32)
+		if (ptr)
+			munmap(const_cast<char*>(ptr), length);
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool isValid() const { return valid; }
+	const char* data() const { return ptr; }
+	size_t size() const { return length; }
+
+private:
+	const char* ptr = nullptr;
+	size_t length = 0;
+	bool valid = false;
+#if defined(_WIN32)
+	std::vector<char> buffer;
+#endif
+};
+
+namespace objloader
+{
+	// What one thread reads from its part of the file. Every face corner takes three slots
+	// in corners: zero-based position, texture coordinate and normal index, -1 where the
+	// face has none. Negative (relative) indices in the file count back from the elements
+	// read so far, which includes those of earlier chunks. They are stored relative to
+	// the first element of this chunk and listed in relative, to be fixed up once the
+	// sizes of the earlier chunks are known.
+	struct Chunk
+	{
+		std::vector<float> positions, normals, texcoords;
+		std::vector<int> corners;
+		std::vector<size_t> relative;
+		bool error = false;
+	};
+
+	inline const char* skipBlanks(const char* p, const char* end)
+	{
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+			++p;
+		return p;
+	}
+
+	inline void parseFloats(const char* p, const char* end, int count, std::vector<float>& out, bool& error)
+	{
+		for (int i = 0; i < count; ++i) {
+			float value = 0;
+			p = skipBlanks(p, end);
+			auto result = std::from_chars(p, end, value);
+			if (result.ec != std::errc())
+				error = true;
+			p = result.ptr;
+			out.push_back(value);
+		}
+	}
+
+	inline void parseChunk(const char* p, const char* end, Chunk& chunk)
+	{
+		std::vector<int> polygon;
+		std::vector<bool> polygonRelative;
+		while (p < end && !chunk.error) {
+			p = skipBlanks(p, end);
+			const char* lineEnd = std::find(p, end, '\n');
+			if (lineEnd - p >= 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+				parseFloats(p + 2, lineEnd, 3, chunk.positions, chunk.error);
+			else if (lineEnd - p >= 3 && p[0] == 'v' && p[1] == 'n')
+				parseFloats(p + 2, lineEnd, 3, chunk.normals, chunk.error);
+			else if (lineEnd - p >= 3 && p[0] == 'v' && p[1] == 't')
+				parseFloats(p + 2, lineEnd, 2, chunk.texcoords, chunk.error);
+			else if (lineEnd - p >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+				// corners are v, v/vt, v//vn or v/vt/vn
+				polygon.clear();
+				polygonRelative.clear();
+				const int counts[3] = { (int)chunk.positions.size() / 3, (int)chunk.texcoords.size() / 2, (int)chunk.normals.size() / 3 };
+				const char* q = skipBlanks(p + 2, lineEnd);
+				while (q < lineEnd && !chunk.error) {
+					int slot[3] = { -1, -1, -1 };
+					bool relative[3] = { false, false, false };
+					for (int k = 0; k < 3; ++k) {
+						if (k > 0) {
+							if (q >= lineEnd || *q != '/')
+								break;
+							++q;
+						}
+						int index = 0;
+						auto result = std::from_chars(q, lineEnd, index);
+						if (result.ec != std::errc() || index == 0) {
+							// only the texture coordinate of v//vn may be left out
+							chunk.error |= k != 1 || result.ec == std::errc();
+							continue;
+						}
+						q = result.ptr;
+						slot[k] = index > 0 ? index - 1 : counts[k] + index;
+						relative[k] = index < 0;
+					}
+					polygon.insert(polygon.end(), slot, slot + 3);
+					polygonRelative.insert(polygonRelative.end(), relative, relative + 3);
+					q = skipBlanks(q, lineEnd);
+				}
+				// triangle fan around the first corner
+				int n = polygon.size() / 3;
+				for (int i = 1; i + 1 < n; ++i) {
+					for (int c : { 0, i, i + 1 }) {
+						for (int k = 0; k < 3; ++k) {
+							if (polygonRelative[c * 3 + k])
+								chunk.relative.push_back(chunk.corners.size());
+							chunk.corners.push_back(polygon[c * 3 + k]);
+						}
+					}
+				}
+			}
+			p = lineEnd + 1;
+		}
+	}
+
+	struct CornerHash
+	{
+		size_t operator()(const std::array<int, 3>& c) const
+		{
+			return (size_t)c[0] * 73856093u ^ (size_t)c[1] * 19349663u ^ (size_t)c[2] * 83492791u;
+		}
+	};
+}
+
+// Load filename into mesh, false if the file cannot be read or is malformed. threadCount 0
+// uses one thread per hardware core. With attributes false, texture coordinates and
+// normals are skipped and the vertices are the positions of the file as they are.
+inline bool LoadObj(const std::string& filename, ObjMesh& mesh, bool attributes = true, int threadCount = 0)
+{
+	using namespace objloader;
+
+	mesh = ObjMesh();
+	MappedFile file(filename);
+	if (!file.isValid())
+		return false;
+	const char* begin = file.data();
+	const char* end = begin + file.size();
+
+	// Chunks of at least 256KB, each starting at the beginning of a line
+	if (threadCount <= 0)
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+	int chunkCount = (int)std::min<size_t>(threadCount, file.size() / (256 << 10) + 1);
+	std::vector<const char*> bounds(chunkCount + 1, end);
+	bounds[0] = begin;
+	for (int c = 1; c < chunkCount; ++c) {
+		const char* p = std::find(std::max(bounds[c - 1], begin + file.size() * c / chunkCount), end, '\n');
+		bounds[c] = p < end ? p + 1 : end;
+	}
+
+	std::vector<Chunk> chunks(chunkCount);
+	std::vector<std::thread> threads;
+	for (int c = 1; c < chunkCount; ++c)
+		threads.emplace_back(parseChunk, bounds[c], bounds[c + 1], std::ref(chunks[c]));
+	parseChunk(bounds[0], bounds[1], chunks[0]);
+	for (auto& t : threads)
+		t.join();
+
+	// Concatenate the chunks, with all face indices absolute
+	std::vector<float> positions, normals, texcoords;
+	std::vector<int> corners;
+	for (Chunk& chunk : chunks) {
+		if (chunk.error)
+			return false;
+		const int offsets[3] = { (int)positions.size() / 3, (int)texcoords.size() / 2, (int)normals.size() / 3 };
+		size_t first = corners.size();
+		corners.insert(corners.end(), chunk.corners.begin(), chunk.corners.end());
+		for (size_t slot : chunk.relative)
+			corners[first + slot] += offsets[slot % 3];
+		positions.insert(positions.end(), chunk.positions.begin(), chunk.positions.end());
+		normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+		texcoords.insert(texcoords.end(), chunk.texcoords.begin(), chunk.texcoords.end());
+	}
+
+	const int counts[3] = { (int)positions.size() / 3, (int)texcoords.size() / 2, (int)normals.size() / 3 };
+	bool used[3] = { true, false, false };
+	for (size_t i = 0; i < corners.size(); ++i) {
+		int k = i % 3;
+		if (corners[i] >= counts[k] || corners[i] < (k == 0 ? 0 : -1))
+			return false;
+		used[k] |= corners[i] >= 0;
+	}
+	bool hasTexcoords = attributes && used[1], hasNormals = attributes && used[2];
+
+	if (!hasTexcoords && !hasNormals) {
+		// the vertices are the positions, no need to look for shared corners
+		mesh.px.resize(counts[0]);
+		mesh.py.resize(counts[0]);
+		mesh.pz.resize(counts[0]);
+		for (int i = 0; i < counts[0]; ++i) {
+			mesh.px[i] = positions[i * 3];
+			mesh.py[i] = positions[i * 3 + 1];
+			mesh.pz[i] = positions[i * 3 + 2];
+		}
+		mesh.indices.resize(corners.size() / 3);
+		for (size_t i = 0; i < mesh.indices.size(); ++i)
+			mesh.indices[i] = corners[i * 3];
+		return true;
+	}
+
+	// One vertex per distinct index triple
+	std::unordered_map<std::array<int, 3>, uint32_t, CornerHash> vertexIds;
+	vertexIds.reserve(corners.size() / 3);
+	mesh.indices.resize(corners.size() / 3);
+	for (size_t i = 0; i < mesh.indices.size(); ++i) {
+		std::array<int, 3> key = { corners[i * 3], hasTexcoords ? corners[i * 3 + 1] : -1, hasNormals ? corners[i * 3 + 2] : -1 };
+		auto inserted = vertexIds.emplace(key, (uint32_t)mesh.px.size());
+		mesh.indices[i] = inserted.first->second;
+		if (!inserted.second)
+			continue;
+		mesh.px.push_back(positions[key[0] * 3]);
+		mesh.py.push_back(positions[key[0] * 3 + 1]);
+		mesh.pz.push_back(positions[key[0] * 3 + 2]);
+		if (hasTexcoords) {
+			mesh.u.push_back(key[1] >= 0 ? texcoords[key[1] * 2] : 0.0f);
+			mesh.v.push_back(key[1] >= 0 ? texcoords[key[1] * 2 + 1] : 0.0f);
+		}
+		if (hasNormals) {
+			mesh.nx.push_back(key[2] >= 0 ? normals[key[2] * 3] : 0.0f);
+			mesh.ny.push_back(key[2] >= 0 ? normals[key[2] * 3 + 1] : 0.0f);
+			mesh.nz.push_back(key[2] >= 0 ? normals[key[2] * 3 + 2] : 0.0f);
+		}
+	}
+	return true;
+}
@@ -10,21 +10,58 @@
 #include "Bounds3.hpp"
 #include "Ray.hpp"
 #include "Intersection.hpp"
+#include "RayPacket.hpp"
 
 class Object
 {
 public:
 	Object() {}
 	virtual ~Object() {}
+	// Any hit along ray before ray.t_max
 	virtual bool intersect(const Ray& ray) = 0;
+	// Any-hit test of the lanes in mask, returns the mask of the occluded ones
+	virtual int intersect(const RayPacket& packet, int mask)
+	{
+		int occluded = 0;
+		for (int i = 0; i < RayPacket::size; ++i) {
+			if ((mask & (1 << i)) && intersect(*packet.rays[i]))
+				occluded |= 1 << i;
+		}
+		return occluded;
+	}
 	virtual bool intersect(const Ray& ray, float&, uint32_t&) const = 0;
 	virtual Intersection getIntersection(Ray _ray) = 0;
+	// Keep the closer of hits[i] and this object's hit for every lane i in mask
+	virtual void getIntersections(const RayPacket& packet, int mask, Intersection* hits)
+	{
+		for (int i = 0; i < RayPacket::size; ++i) {
+			if (!(mask & (1 << i)))
+				continue;
+			Intersection hit = getIntersection(*packet.rays[i]);
+			if (hit.happened && hit.distance < hits[i].distance)
+				hits[i] = hit;
+		}
+	}
 	virtual void getSurfaceProperties(const Vector3f&, const Vector3f&, const uint32_t&, const Vector2f&, Vector3f&, Vector2f&) const = 0;
 	virtual Vector3f evalDiffuseColor(const Vector2f&) const = 0;
 	virtual Bounds3 getBounds() = 0;
 	virtual float getArea() = 0;
 	virtual void Sample(Intersection& pos, float& pdf) = 0;
 	virtual bool hasEmit() = 0;
+	virtual Vector3f getEmission() = 0;
+	// Emissive objects are sampled in parts, the scene keeps a table of all of them: every
+	// triangle of a mesh, or the object as a whole. SampleEmitter draws a point on part i,
+	// uniform over its area.
+	virtual uint32_t getEmitterCount() { return 1; }
+	virtual float getEmitterArea(uint32_t) { return getArea(); }
+	virtual Bounds3 getEmitterBounds(uint32_t) { return getBounds(); }
+	virtual void SampleEmitter(uint32_t, Intersection& pos)
+	{
+		float pdf;
+		Sample(pos, pdf);
+	}
+	// objects with an acceleration structure of their own switch it to width-ary nodes
+	virtual void setBVHWidth(int width) {}
 };
 
 #endif //RAYTRACING_OBJECT_H
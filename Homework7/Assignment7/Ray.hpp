@@ -7,6 +7,8 @@
 
 #include "Vector.hpp"
 
+#include <limits>
+
 struct Ray
 {
 	//Destination = origin + t*direction
@@ -25,6 +27,9 @@ struct Ray
 
 	Vector3f operator()(double t) const { return origin + direction * t; }
 
+	// t_max narrowed to float for the BVH and triangle tests, where "unbounded" is infinity
+	float maxDistance() const { return t_max < std::numeric_limits<float>::max() ? (float)t_max : std::numeric_limits<float>::infinity(); }
+
 	friend std::ostream& operator<<(std::ostream& os, const Ray& r)
 	{
 		os << "[origin:=" << r.origin << ", direction=" << r.direction << ", time=" << r.t << "]\n";
@@ -0,0 +1,82 @@
+//
+// A small bundle of coherent rays traced through the BVH together.
+//
+
+#ifndef RAYTRACING_RAYPACKET_H
+#define RAYTRACING_RAYPACKET_H
+
+#include "Ray.hpp"
+#include "Bounds3.hpp"
+
+#include <algorithm>
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+// The rays are kept both as Ray (for the per-primitive tests) and split into
+// per-component lanes, so a box is tested against the whole packet in one loop.
+// A set bit in active marks a lane that holds a ray.
+struct RayPacket
+{
+	static constexpr int size = 8;
+
+	const Ray* rays[size];
+	alignas(32) float ox[size], oy[size], oz[size];
+	alignas(32) float invDx[size], invDy[size], invDz[size];
+	int active = 0;
+	// direction signs of the first ray, which picks the child order for the whole packet
+	std::array<int, 3> dirIsNeg = { 0, 0, 0 };
+
+	RayPacket()
+	{
+		for (int i = 0; i < size; ++i) {
+			rays[i] = nullptr;
+			ox[i] = oy[i] = oz[i] = 0;
+			invDx[i] = invDy[i] = invDz[i] = 0;
+		}
+	}
+
+	// ray has to outlive the packet
+	void set(int lane, const Ray& ray)
+	{
+		if (active == 0)
+			dirIsNeg = { ray.direction.x < 0, ray.direction.y < 0, ray.direction.z < 0 };
+		rays[lane] = &ray;
+		ox[lane] = ray.origin.x; oy[lane] = ray.origin.y; oz[lane] = ray.origin.z;
+		invDx[lane] = ray.direction_inv.x; invDy[lane] = ray.direction_inv.y; invDz[lane] = ray.direction_inv.z;
+		active |= 1 << lane;
+	}
+};
+
+// Slab test of every lane against one box, returns the mask of the lanes in mask
+// that enter it before their tMax
+inline int IntersectP(const Bounds3& bounds, const RayPacket& packet, const float* tMax, int mask)
+{
+	int hit = 0;
+#if defined(__SSE__)
+	// four lanes per step, the same min/max sequence as the loop below
+	for (int i = 0; i < RayPacket::size; i += 4) {
+		__m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.pMin.x), _mm_load_ps(packet.ox + i)), _mm_load_ps(packet.invDx + i));
+		__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.pMax.x), _mm_load_ps(packet.ox + i)), _mm_load_ps(packet.invDx + i));
+		__m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.pMin.y), _mm_load_ps(packet.oy + i)), _mm_load_ps(packet.invDy + i));
+		__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.pMax.y), _mm_load_ps(packet.oy + i)), _mm_load_ps(packet.invDy + i));
+		__m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.pMin.z), _mm_load_ps(packet.oz + i)), _mm_load_ps(packet.invDz + i));
+		__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bounds.pMax.z), _mm_load_ps(packet.oz + i)), _mm_load_ps(packet.invDz + i));
+		__m128 enter = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+		__m128 leave = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_loadu_ps(tMax + i)));
+		hit |= _mm_movemask_ps(_mm_cmple_ps(enter, leave)) << i;
+	}
+#else
+	for (int i = 0; i < RayPacket::size; ++i) {
+		float tx0 = (bounds.pMin.x - packet.ox[i]) * packet.invDx[i], tx1 = (bounds.pMax.x - packet.ox[i]) * packet.invDx[i];
+		float ty0 = (bounds.pMin.y - packet.oy[i]) * packet.invDy[i], ty1 = (bounds.pMax.y - packet.oy[i]) * packet.invDy[i];
+		float tz0 = (bounds.pMin.z - packet.oz[i]) * packet.invDz[i], tz1 = (bounds.pMax.z - packet.oz[i]) * packet.invDz[i];
+		float enter = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), 0.0f));
+		float leave = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::min(std::max(tz0, tz1), tMax[i]));
+		hit |= (enter <= leave) << i;
+	}
+#endif
+	return hit & mask;
+}
+
+#endif //RAYTRACING_RAYPACKET_H
@@ -4,44 +4,224 @@
 
 #include "Scene.hpp"
 #include "Renderer.hpp"
+#include "WavefrontIntegrator.hpp"
 
 #include <fstream>
-
-inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <memory>
 
 const float EPSILON = 0.00001;
 
-// The main render function. This where we iterate over all pixels in the image,
-// generate primary rays and cast these rays into the scene. The content of the
-// framebuffer is saved to a file.
-void Renderer::Render(const Scene& scene)
+// Render all pixels of the tile [x0, x1) x [y0, y1). Every sample moves the
+// thread's sampler to the stream of (seed, pixel, sample), so the result does not
+// depend on the thread that picks up the tile.
+void Renderer::RenderTile(const Scene& scene, std::vector<Vector3f>& framebuffer, int x0, int y0, int x1, int y1) const
 {
-	std::vector<Vector3f> framebuffer(scene.width * scene.height);
+	Camera camera(scene);
+	Sampler& sampler = GetThreadSampler();
 
-	float scale = tan(deg2rad(scene.fov * 0.5));
-	float imageAspectRatio = scene.width / (float)scene.height;
-	Vector3f eye_pos(278, 273, -800);
-	int m = 0;
+	for (int j = y0; j < y1; ++j) {
+		for (int i = x0; i < x1; ++i) {
+			int m = j * scene.width + i;
 
-	// change the spp value to change sample ammount
-	int spp = 16;
-	std::cout << "SPP: " << spp << "\n";
-	for (uint32_t j = 0; j < scene.height; ++j) {
-		for (uint32_t i = 0; i < scene.width; ++i) {
-			// generate primary ray direction
-			float x = (2 * (i + 0.5) / (float)scene.width - 1) *
-				imageAspectRatio * scale;
-			float y = (1 - 2 * (j + 0.5) / (float)scene.height) * scale;
-
-			Vector3f dir = normalize(Vector3f(-x, y, 1));
+			Vector3f dir = camera.direction(i, j);
 			for (int k = 0; k < spp; k++) {
-				framebuffer[m] += scene.castRay(Ray(eye_pos, dir), 0) / spp;
+				sampler.StartPixelSample(m, k, seed);
+				framebuffer[m] += scene.castRay(Ray(camera.eye_pos, dir), 0) / spp;
 			}
-			m++;
 		}
-		UpdateProgress(j / (float)scene.height);
 	}
+}
+
+// Packet version of RenderTile. Camera rays do not depend on the sample, so each run
+// of RayPacket::size pixels is intersected once for all samples. Per sample, the first
+// shadow rays of the run are traced as a packet too, then every path continues on its
+// own. Each lane keeps its own sampler state across the packet steps, which keeps the
+// random streams (and the image) identical to RenderTile.
+void Renderer::RenderTilePackets(const Scene& scene, std::vector<Vector3f>& framebuffer, int x0, int y0, int x1, int y1) const
+{
+	Camera camera(scene);
+	Sampler& sampler = GetThreadSampler();
+
+	// reserved up front, the packets point into them
+	std::vector<Ray> cameraRays, shadowRays;
+	cameraRays.reserve(RayPacket::size);
+	shadowRays.reserve(RayPacket::size);
+	Intersection hits[RayPacket::size];
+	LightSample lightSamples[RayPacket::size];
+	Sampler laneSamplers[RayPacket::size];
+
+	for (int j = y0; j < y1; ++j) {
+		for (int i0 = x0; i0 < x1; i0 += RayPacket::size) {
+			int n = std::min(RayPacket::size, x1 - i0);
+			RayPacket packet;
+			cameraRays.clear();
+			for (int l = 0; l < n; ++l) {
+				cameraRays.emplace_back(camera.eye_pos, camera.direction(i0 + l, j));
+				packet.set(l, cameraRays[l]);
+				hits[l] = Intersection();
+			}
+			scene.intersect(packet, hits);
+
+			for (int k = 0; k < spp; k++) {
+				RayPacket shadowPacket;
+				shadowRays.clear();
+				for (int l = 0; l < n; ++l) {
+					sampler.StartPixelSample(j * scene.width + i0 + l, k, seed);
+					if (hits[l].happened && !hits[l].m->hasEmission()) {
+						lightSamples[l] = scene.sampleDirect(hits[l]);
+						shadowRays.push_back(lightSamples[l].shadowRay());
+						shadowPacket.set(l, shadowRays.back());
+					}
+					laneSamplers[l] = sampler;
+				}
+				int occluded = scene.intersectP(shadowPacket);
+
+				for (int l = 0; l < n; ++l) {
+					sampler = laneSamplers[l];
+					framebuffer[j * scene.width + i0 + l] += scene.shade(cameraRays[l], hits[l], lightSamples[l], !(occluded & (1 << l)), 0) / spp;
+				}
+			}
+		}
+	}
+}
+
+// Accumulation buffers of the progressive mode. Besides the color sum, every pixel keeps
+// the running sums of its samples' luminance and squared luminance to estimate its variance.
+struct PixelStats
+{
+	Vector3f sum;
+	double lumSum = 0, lumSqSum = 0;
+	int count = 0;
+
+	void add(const Vector3f& L)
+	{
+		double lum = 0.2126 * L.x + 0.7152 * L.y + 0.0722 * L.z;
+		sum += L;
+		lumSum += lum;
+		lumSqSum += lum * lum;
+		++count;
+	}
+
+	// Standard error of the mean luminance, carried through the x^0.6 curve the image is
+	// saved with (derivative 0.6 x^-0.4), so the error is measured in displayed intensity
+	double displayError() const
+	{
+		if (count < 2)
+			return std::numeric_limits<double>::infinity();
+		double mean = lumSum / count;
+		double variance = std::max(0.0, (lumSqSum - count * mean * mean) / (count - 1));
+		return 0.6 * std::sqrt(variance / count) / std::pow(std::max(mean, 0.01), 0.4);
+	}
+};
+
+void Renderer::ForEachTile(const Scene& scene, int threadCount, const std::function<TileRenderer()>& startWorker) const
+{
+	int tilesX = (scene.width + tileSize - 1) / tileSize;
+	int tilesY = (scene.height + tileSize - 1) / tileSize;
+	int tileCount = tilesX * tilesY;
+
+	std::atomic<int> nextTile(0);
+	std::atomic<int> finishedTiles(0);
+	auto worker = [&]() {
+		TileRenderer renderTile = startWorker();
+		for (int t = nextTile++; t < tileCount; t = nextTile++) {
+			int x0 = (t % tilesX) * tileSize;
+			int y0 = (t / tilesX) * tileSize;
+			renderTile(x0, y0, std::min(x0 + tileSize, scene.width), std::min(y0 + tileSize, scene.height));
+			UpdateProgress(++finishedTiles / (float)tileCount);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (int t = 1; t < std::min(threadCount, tileCount); ++t)
+		threads.emplace_back(worker);
+	worker();
+	for (auto& thread : threads)
+		thread.join();
 	UpdateProgress(1.f);
+}
+
+// Progressive rendering with adaptive sampling. Each pass adds spp samples to every pixel
+// still marked active. Sample k of a pixel always uses stream (pixel, k), so the first
+// pass draws exactly the samples of a plain render with spp samples.
+void Renderer::RenderProgressive(const Scene& scene, std::vector<Vector3f>& framebuffer, int threadCount) const
+{
+	Camera camera(scene);
+	std::vector<PixelStats> stats(scene.width * scene.height);
+	std::vector<char> active(scene.width * scene.height, 1);
+	auto start = std::chrono::steady_clock::now();
+
+	// two samples at least, the variance estimate needs them
+	int passSpp = std::max(spp, 2);
+	TileRenderer renderTile = [&](int x0, int y0, int x1, int y1) {
+		Sampler& sampler = GetThreadSampler();
+		for (int j = y0; j < y1; ++j) {
+			for (int i = x0; i < x1; ++i) {
+				int m = j * scene.width + i;
+				if (!active[m])
+					continue;
+				Vector3f dir = camera.direction(i, j);
+				int target = std::min(maxSpp, stats[m].count + passSpp);
+				while (stats[m].count < target) {
+					sampler.StartPixelSample(m, stats[m].count, seed);
+					stats[m].add(scene.castRay(Ray(camera.eye_pos, dir), 0));
+				}
+			}
+		}
+	};
+	int activePixels = active.size();
+	for (int pass = 0; activePixels > 0; ++pass) {
+		std::cout << "\nPass " << pass << ": " << activePixels << " pixels\n";
+		ForEachTile(scene, threadCount, [&]() { return renderTile; });
+
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		bool outOfTime = timeBudget > 0 && elapsed >= timeBudget;
+		activePixels = 0;
+		for (size_t m = 0; m < stats.size(); ++m) {
+			active[m] = !outOfTime && stats[m].count < maxSpp && stats[m].displayError() > errorThreshold;
+			activePixels += active[m];
+		}
+	}
+
+	long long totalSamples = 0;
+	for (size_t m = 0; m < stats.size(); ++m) {
+		framebuffer[m] = stats[m].sum / stats[m].count;
+		totalSamples += stats[m].count;
+	}
+	std::cout << "\nAverage SPP: " << totalSamples / (double)stats.size() << "\n";
+}
+
+// The main render function. This where we split the image into tiles and let a
+// pool of threads pull them from a shared counter, so faster threads simply take
+// more tiles. The content of the framebuffer is saved to a file.
+void Renderer::Render(const Scene& scene)
+{
+	std::vector<Vector3f> framebuffer(scene.width * scene.height);
+
+	int threadCount = numThreads > 0 ? numThreads : std::max(1u, std::thread::hardware_concurrency());
+
+	std::cout << "SPP: " << spp << "\n";
+	std::cout << "Threads: " << threadCount << "\n";
+
+	if (progressive)
+		RenderProgressive(scene, framebuffer, threadCount);
+	else {
+		ForEachTile(scene, threadCount, [&]() -> TileRenderer {
+			if (integrator == Integrator::Wavefront) {
+				// one integrator per thread, its queues are reused across tiles
+				auto wavefront = std::make_shared<WavefrontIntegrator>(scene);
+				return [&, wavefront](int x0, int y0, int x1, int y1) {
+					wavefront->RenderTile(framebuffer, x0, y0, x1, y1, spp, seed);
+				};
+			}
+			if (integrator == Integrator::Packet)
+				return [&](int x0, int y0, int x1, int y1) { RenderTilePackets(scene, framebuffer, x0, y0, x1, y1); };
+			return [&](int x0, int y0, int x1, int y1) { RenderTile(scene, framebuffer, x0, y0, x1, y1); };
+			});
+	}
 
 	// save framebuffer to file
 	FILE* fp = fopen("binary.ppm", "wb");
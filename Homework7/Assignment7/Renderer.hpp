@@ -6,6 +6,33 @@
 
 #include "Scene.hpp"
 
+#include <functional>
+
+inline float deg2rad(const float& deg) { return deg * M_PI / 180.0; }
+
+// Pinhole camera looking into the Cornell box, shared by the integrators
+struct Camera
+{
+	Vector3f eye_pos = Vector3f(278, 273, -800);
+	float scale, imageAspectRatio;
+	int width, height;
+
+	explicit Camera(const Scene& scene)
+		: scale(tan(deg2rad(scene.fov * 0.5))), imageAspectRatio(scene.width / (float)scene.height),
+		width(scene.width), height(scene.height)
+	{
+	}
+
+	// generate primary ray direction through the center of pixel (i, j)
+	Vector3f direction(int i, int j) const
+	{
+		float x = (2 * (i + 0.5) / (float)width - 1) *
+			imageAspectRatio * scale;
+		float y = (1 - 2 * (j + 0.5) / (float)height) * scale;
+		return normalize(Vector3f(-x, y, 1));
+	}
+};
+
 struct hit_payload
 {
 	float tNear;
@@ -17,5 +44,38 @@ struct hit_payload
 class Renderer
 {
 public:
+	// setting up options
+	int spp = 16;
+	int tileSize = 32;
+	int numThreads = 0; // 0 means one thread per hardware core
+	uint32_t seed = 0;
+	enum class Integrator
+	{
+		Recursive, // one castRay per sample
+		Packet,    // camera and first shadow rays in RayPackets, then castRay
+		Wavefront  // WavefrontIntegrator, all paths of a tile bounce by bounce
+	};
+	Integrator integrator = Integrator::Packet;
+
+	// Progressive mode renders in passes of spp samples per pixel. After the first pass only
+	// pixels whose estimated error (standard error of the displayed intensity, in [0, 1]) is
+	// still above errorThreshold get another pass, until they reach maxSpp or the passes
+	// run past timeBudget.
+	bool progressive = false;
+	int maxSpp = 1024;
+	float errorThreshold = 0.01f;
+	float timeBudget = 0; // seconds, 0 means no limit
+
 	void Render(const Scene& scene);
+
+private:
+	// renders the tile [x0, x1) x [y0, y1) given as (x0, y0, x1, y1)
+	using TileRenderer = std::function<void(int, int, int, int)>;
+	// Hand the tiles of the image to threadCount threads. Every thread calls startWorker
+	// once and renders all its tiles with the TileRenderer it returns, which can keep
+	// per-thread state such as the queues of a WavefrontIntegrator.
+	void ForEachTile(const Scene& scene, int threadCount, const std::function<TileRenderer()>& startWorker) const;
+	void RenderProgressive(const Scene& scene, std::vector<Vector3f>& framebuffer, int threadCount) const;
+	void RenderTile(const Scene& scene, std::vector<Vector3f>& framebuffer, int x0, int y0, int x1, int y1) const;
+	void RenderTilePackets(const Scene& scene, std::vector<Vector3f>& framebuffer, int x0, int y0, int x1, int y1) const;
 };
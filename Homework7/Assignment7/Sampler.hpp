@@ -0,0 +1,91 @@
+//
+// Per-thread random number generation for the path tracer.
+//
+
+#ifndef RAYTRACING_SAMPLER_H
+#define RAYTRACING_SAMPLER_H
+
+#include <cstdint>
+
+// 64-bit finalizer from MurmurHash3, used to turn (pixel, seed) into well spread
+// stream ids
+inline uint64_t MixBits(uint64_t v)
+{
+	v ^= (v >> 31);
+	v *= 0x7fb5d329728ea185ULL;
+	v ^= (v >> 27);
+	v *= 0x81dadef4bc2dd44dULL;
+	v ^= (v >> 33);
+	return v;
+}
+
+// PCG32 generator (XSH-RR output, 64-bit state). Every (pixel, seed) pair gets its
+// own stream and every sample starts at a fixed offset inside that stream, so a
+// sample draws the same numbers no matter which thread evaluates it.
+class Sampler
+{
+public:
+	Sampler() : state(0x853c49e6748fea9bULL), inc(0xda3e39cb94b95bdbULL) {}
+	Sampler(uint64_t seqIndex, uint64_t offset) { SetSequence(seqIndex, offset); }
+
+	void SetSequence(uint64_t seqIndex, uint64_t offset)
+	{
+		state = 0u;
+		inc = (seqIndex << 1u) | 1u;
+		UniformUInt32();
+		state += offset;
+		UniformUInt32();
+	}
+
+	void SetSequence(uint64_t seqIndex) { SetSequence(seqIndex, MixBits(seqIndex)); }
+
+	// start drawing the numbers of one sample of one pixel
+	void StartPixelSample(uint32_t pixelIndex, uint32_t sampleIndex, uint32_t seed = 0)
+	{
+		SetSequence(MixBits(((uint64_t)pixelIndex << 32) ^ seed));
+		Advance((uint64_t)sampleIndex * 65536ull);
+	}
+
+	uint32_t UniformUInt32()
+	{
+		uint64_t oldstate = state;
+		state = oldstate * PCG32_MULT + inc;
+		uint32_t xorshifted = (uint32_t)(((oldstate >> 18u) ^ oldstate) >> 27u);
+		uint32_t rot = (uint32_t)(oldstate >> 59u);
+		return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+	}
+
+	// uniform float in [0, 1)
+	float Uniform() { return (UniformUInt32() >> 8) * 0x1p-24f; }
+
+	// jump ahead by delta draws in O(log delta)
+	void Advance(uint64_t delta)
+	{
+		uint64_t curMult = PCG32_MULT, curPlus = inc, accMult = 1u;
+		uint64_t accPlus = 0u;
+		while (delta > 0) {
+			if (delta & 1) {
+				accMult *= curMult;
+				accPlus = accPlus * curMult + curPlus;
+			}
+			curPlus = (curMult + 1) * curPlus;
+			curMult *= curMult;
+			delta /= 2;
+		}
+		state = accMult * state + accPlus;
+	}
+
+private:
+	static constexpr uint64_t PCG32_MULT = 0x5851f42d4c957f2dULL;
+
+	uint64_t state, inc;
+};
+
+// the sampler of the calling thread, every render thread owns one
+inline Sampler& GetThreadSampler()
+{
+	thread_local Sampler sampler;
+	return sampler;
+}
+
+#endif //RAYTRACING_SAMPLER_H
@@ -4,10 +4,16 @@
 
 #include "Scene.hpp"
 
-void Scene::buildBVH()
+void Scene::buildBVH(int bvhWidth)
 {
 	printf(" - Generating BVH...\n\n");
-	this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::NAIVE);
+	this->bvh = new BVHAccel(objects, 1, BVHAccel::SplitMethod::SAH);
+	if (bvhWidth != 2) {
+		this->bvh->Widen(bvhWidth);
+		for (Object* object : objects)
+			object->setBVHWidth(bvhWidth);
+	}
+	lightSampler.build(objects, useLightBVH);
 }
 
 Intersection Scene::intersect(const Ray& ray) const
@@ -15,25 +21,24 @@ Intersection Scene::intersect(const Ray& ray) const
 	return this->bvh->Intersect(ray);
 }
 
-void Scene::sampleLight(Intersection& pos, float& pdf) const
+void Scene::intersect(const RayPacket& packet, Intersection* hits) const
 {
-	float emit_area_sum = 0;
-	for (uint32_t k = 0; k < objects.size(); ++k) {
-		if (objects[k]->hasEmit()) {
-			emit_area_sum += objects[k]->getArea();
-		}
-	}
-	float p = get_random_float() * emit_area_sum;
-	emit_area_sum = 0;
-	for (uint32_t k = 0; k < objects.size(); ++k) {
-		if (objects[k]->hasEmit()) {
-			emit_area_sum += objects[k]->getArea();
-			if (p <= emit_area_sum) {
-				objects[k]->Sample(pos, pdf);
-				break;
-			}
-		}
-	}
+	this->bvh->Intersect(packet, hits);
+}
+
+bool Scene::intersectP(const Ray& ray) const
+{
+	return this->bvh->IntersectP(ray);
+}
+
+int Scene::intersectP(const RayPacket& packet) const
+{
+	return this->bvh->IntersectP(packet);
+}
+
+void Scene::sampleLight(const Vector3f& p, Intersection& pos, float& pdf) const
+{
+	lightSampler.Sample(p, pos, pdf);
 }
 
 bool Scene::trace(const Ray& ray, const std::vector<Object*>& objects, float& tNear, uint32_t& index, Object** hitObject)
@@ -52,8 +57,102 @@ bool Scene::trace(const Ray& ray, const std::vector<Object*>& objects, float& tN
 	return (*hitObject != nullptr);
 }
 
+// Power heuristic weight of a strategy with pdf pdfA against one with pdfB
+static float powerHeuristic(float pdfA, float pdfB)
+{
+	float a2 = pdfA * pdfA, b2 = pdfB * pdfB;
+	return a2 + b2 > 0 ? a2 / (a2 + b2) : 0.0f;
+}
+
+float Scene::lightPdf(const Vector3f& p, const Intersection& light, const Vector3f& ws) const
+{
+	float cosLight = dotProduct(-ws, normalize(light.normal));
+	if (cosLight <= 0)
+		return 0.0f;
+	float distance2 = dotProduct(light.coords - p, light.coords - p);
+	return lightSampler.Pdf(p, light) * distance2 / cosLight;
+}
+
 // Implementation of Path Tracing
-Vector3f Scene::castRay(const Ray& ray, int depth) const
+Vector3f Scene::castRay(const Ray& ray, int depth, float bsdfPdf) const
 {
 	// TO DO Implement Path Tracing Algorithm here
+	Intersection inter = intersect(ray);
+	if (!inter.happened || inter.m->hasEmission())
+		return shade(ray, inter, LightSample(), false, depth, bsdfPdf);
+
+	LightSample lightSample = sampleDirect(inter);
+	return shade(ray, inter, lightSample, !intersectP(lightSample.shadowRay()), depth);
+}
+
+LightSample Scene::sampleDirect(const Intersection& inter) const
+{
+	LightSample lightSample;
+	sampleLight(inter.coords, lightSample.light, lightSample.pdf);
+	Vector3f d = lightSample.light.coords - inter.coords;
+	lightSample.origin = inter.coords;
+	lightSample.ws = normalize(d);
+	lightSample.distance = d.norm();
+	return lightSample;
+}
+
+Vector3f Scene::directLight(const Vector3f& wo, const Intersection& inter, const LightSample& lightSample) const
+{
+	Vector3f N = normalize(inter.normal);
+	Vector3f NN = normalize(lightSample.light.normal);
+	Vector3f ws = lightSample.ws;
+	float distance = lightSample.distance;
+	// lights are one-sided, like the back-face culled triangles that used to block them
+	float cosLight = dotProduct(-ws, NN);
+	if (lightSample.pdf <= 0 || cosLight <= 0)
+		return Vector3f(0.0f);
+	// weighted against the bounce ray finding the same point, which continues a path with
+	// probability RussianRoulette
+	float pdf = lightSample.pdf * distance * distance / cosLight;
+	float weight = powerHeuristic(pdf, inter.m->pdf(wo, ws, N) * RussianRoulette);
+	return lightSample.light.emit * inter.m->eval(wo, ws, N) * dotProduct(ws, N) * weight / pdf;
+}
+
+Vector3f Scene::emitted(const Ray& ray, const Intersection& inter, int depth, float bsdfPdf) const
+{
+	// seen directly, or through a bounce the light samples could not have found
+	if (depth == 0 || bsdfPdf <= 0)
+		return inter.m->getEmission();
+	float pdf = lightPdf(ray.origin, inter, ray.direction);
+	if (pdf <= 0)
+		return Vector3f(0.0f);
+	return inter.m->getEmission() * powerHeuristic(bsdfPdf, pdf);
+}
+
+Vector3f Scene::shade(const Ray& ray, const Intersection& inter, const LightSample& lightSample, bool lightVisible, int depth, float bsdfPdf) const
+{
+	if (!inter.happened)
+		return Vector3f(0.0f);
+
+	// light sources found by a bounce share their light with the light samples by MIS
+	if (inter.m->hasEmission())
+		return emitted(ray, inter, depth, bsdfPdf);
+
+	Vector3f p = inter.coords;
+	Vector3f N = normalize(inter.normal);
+	Vector3f wo = ray.direction;
+	Material* m = inter.m;
+
+	// contribution from the light source
+	Vector3f L_dir(0.0f);
+	if (lightVisible)
+		L_dir = directLight(wo, inter, lightSample);
+
+	// contribution from other reflectors
+	Vector3f L_indir(0.0f);
+	if (get_random_float() < RussianRoulette) {
+		Vector3f wi = normalize(m->sample(wo, N));
+		float pdf = m->pdf(wo, wi, N);
+		if (pdf > EPSILON) {
+			L_indir = castRay(Ray(p, wi), depth + 1, pdf * RussianRoulette) * m->eval(wo, wi, N) * dotProduct(wi, N)
+				/ pdf / RussianRoulette;
+		}
+	}
+
+	return L_dir + L_indir;
 }
@@ -9,10 +9,29 @@
 #include "Light.hpp"
 #include "AreaLight.hpp"
 #include "BVH.hpp"
+#include "LightSampler.hpp"
 #include "Ray.hpp"
 
 #include <vector>
 
+// Next event estimation at a surface point: a point on a light, its pdf and the
+// shadow ray from the surface toward it
+struct LightSample
+{
+	Intersection light;
+	float pdf = 0.0f;
+	Vector3f origin, ws;
+	float distance = 0.0f;
+
+	// stops just short of the light, so only blockers in between count
+	Ray shadowRay() const
+	{
+		Ray ray(origin, ws);
+		ray.t_max = distance - 0.01f;
+		return ray;
+	}
+};
+
 class Scene
 {
 public:
@@ -23,6 +42,9 @@ public:
 	Vector3f backgroundColor = Vector3f(0.235294, 0.67451, 0.843137);
 	int maxDepth = 1;
 	float RussianRoulette = 0.8;
+	// Pick lights through a light BVH by their estimated contribution rather than by area,
+	// for scenes with many lights; read by buildBVH
+	bool useLightBVH = false;
 
 	Scene(int w, int h)
 		: width(w), height(h)
@@ -35,16 +57,38 @@ public:
 	const std::vector<Object*>& get_objects() const { return objects; }
 	const std::vector<std::unique_ptr<Light> >& get_lights() const { return lights; }
 	Intersection intersect(const Ray& ray) const;
+	void intersect(const RayPacket& packet, Intersection* hits) const;
+	// Is anything hit before ray.t_max? Cheaper than intersect, for shadow rays.
+	bool intersectP(const Ray& ray) const;
+	int intersectP(const RayPacket& packet) const;
 	BVHAccel* bvh;
-	void buildBVH();
-	Vector3f castRay(const Ray& ray, int depth) const;
-	void sampleLight(Intersection& pos, float& pdf) const;
+	// bvhWidth selects the binary BVH (2) or its 4-/8-wide collapsed form, for the scene and its meshes
+	void buildBVH(int bvhWidth = 2);
+	// Direct lighting is sampled both from the lights and by the bounce ray, the two are
+	// combined by multiple importance sampling with the power heuristic. bsdfPdf is the
+	// solid angle pdf ray was drawn with, 0 for camera rays.
+	Vector3f castRay(const Ray& ray, int depth, float bsdfPdf = 0) const;
+	// castRay split at its two visibility queries, so callers can trace the first hits
+	// and the shadow rays in packets: shade() continues from the hit inter of ray, given
+	// the light sample drawn by sampleDirect(inter) and whether its shadow ray got through.
+	LightSample sampleDirect(const Intersection& inter) const;
+	Vector3f shade(const Ray& ray, const Intersection& inter, const LightSample& lightSample, bool lightVisible, int depth, float bsdfPdf = 0) const;
+	// Radiance the light sample sends toward -wo at inter, before the shadow test, MIS weighted
+	Vector3f directLight(const Vector3f& wo, const Intersection& inter, const LightSample& lightSample) const;
+	// Radiance of the light ray hit in inter, MIS weighted when ray was a bounce
+	Vector3f emitted(const Ray& ray, const Intersection& inter, int depth, float bsdfPdf) const;
+	// Point pos on the lights seen from p and its pdf with respect to area
+	void sampleLight(const Vector3f& p, Intersection& pos, float& pdf) const;
+	// Solid angle pdf of sampleLight(p, ...) drawing the point of light, seen along ws
+	float lightPdf(const Vector3f& p, const Intersection& light, const Vector3f& ws) const;
 	bool trace(const Ray& ray, const std::vector<Object*>& objects, float& tNear, uint32_t& index, Object** hitObject);
 	std::tuple<Vector3f, Vector3f> HandleAreaLight(const AreaLight& light, const Vector3f& hitPoint, const Vector3f& N, const Vector3f& shadowPointOrig, const std::vector<Object*>& objects, uint32_t& index, const Vector3f& dir, float specularExponent);
 
 	// creating the scene (adding objects and lights)
 	std::vector<Object* > objects;
 	std::vector<std::unique_ptr<Light> > lights;
+	// emissive triangles and objects, built with the BVH
+	LightSampler lightSampler;
 
 	// Compute reflection direction
 	Vector3f reflect(const Vector3f& I, const Vector3f& N) const
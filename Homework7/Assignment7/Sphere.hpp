@@ -33,7 +33,7 @@ public:
 		float area = 4 * M_PI * radius2;
 		if (!solveQuadratic(a, b, c, t0, t1)) return false;
 		if (t0 < 0) t0 = t1;
-		if (t0 < 0) return false;
+		if (t0 < 0 || t0 >= ray.t_max) return false;
 		return true;
 	}
 	bool intersect(const Ray& ray, float& tnear, uint32_t& index) const
@@ -105,6 +105,10 @@ public:
 	{
 		return m->hasEmission();
 	}
+	Vector3f getEmission()
+	{
+		return m->getEmission();
+	}
 };
 
 #endif //RAYTRACING_SPHERE_H
@@ -3,12 +3,14 @@
 #include "BVH.hpp"
 #include "Intersection.hpp"
 #include "Material.hpp"
-#include "OBJ_Loader.hpp"
+#include "MeshCache.hpp"
+#include "ObjLoader.hpp"
 #include "Object.hpp"
 #include "Triangle.hpp"
 
-#include <cassert>
 #include <array>
+#include <memory>
+#include <stdexcept>
 
 bool rayTriangleIntersect(const Vector3f& v0, const Vector3f& v1, const Vector3f& v2, const Vector3f& orig, const Vector3f& dir, float& tnear, float& u, float& v)
 {
@@ -73,6 +75,7 @@ public:
 		float x = std::sqrt(get_random_float()), y = get_random_float();
 		pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
 		pos.normal = this->normal;
+		pos.emit = m->getEmission();
 		pdf = 1.0f / area;
 	}
 	float getArea()
@@ -83,19 +86,62 @@ public:
 	{
 		return m->hasEmission();
 	}
+	Vector3f getEmission()
+	{
+		return m->getEmission();
+	}
 };
 
 class MeshTriangle : public Object
 {
 public:
+	// leaves of the mesh BVH hold up to this many triangles, tested in one batch
+	static constexpr int maxTrianglesInLeaf = 8;
+
+	// SAH cost of a node visit relative to one triangle test, see BVHAccel
+	static constexpr float bvhTraversalCost = 3.0f;
+
+	// The mesh and its BVH come from filename.meshcache when that was written for the
+	// current filename. Otherwise they are built and the cache is written for the next run.
 	MeshTriangle(const std::string& filename, Material* mt = new Material())
 	{
-		objl::Loader loader;
-		loader.LoadFile(filename);
-		area = 0;
 		m = mt;
-		assert(loader.LoadedMeshes.size() == 1);
-		auto mesh = loader.LoadedMeshes[0];
+		std::string cachePath = filename + ".meshcache";
+		FileStamp stamp;
+		if (!FileStamp::Of(filename, stamp))
+			throw std::runtime_error("cannot load " + filename);
+		cache = MeshCache::Open(cachePath, stamp, maxTrianglesInLeaf, bvhTraversalCost);
+		if (!cache) {
+			cache = build(filename, stamp);
+			if (!cache->Save(cachePath))
+				std::cerr << "cannot write " << cachePath << "\n";
+		}
+
+		const MeshCache::Header& header = cache->header();
+		numTriangles = header.triangleCount;
+		area = header.area;
+		bounding_box = Bounds3(Vector3f(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]),
+			Vector3f(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]));
+		vx = cache->get<float>(MeshCache::VertexX);
+		vy = cache->get<float>(MeshCache::VertexY);
+		vz = cache->get<float>(MeshCache::VertexZ);
+		vertexIndex = cache->get<uint32_t>(MeshCache::VertexIndex);
+		areaCdf = cache->get<float>(MeshCache::AreaCdf);
+		ArrayView<float>* edges[] = { &v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z };
+		for (int i = 0; i < 9; ++i)
+			*edges[i] = cache->get<float>(MeshCache::Section(MeshCache::V0X + i));
+		bvh = new BVHAccel(cache->get<LinearBVHNode>(MeshCache::BVHNodes), maxTrianglesInLeaf);
+	}
+
+	// Load filename and build the BVH over its triangles, laid out as a mesh cache
+	static std::unique_ptr<MeshCache> build(const std::string& filename, const FileStamp& stamp)
+	{
+		ObjMesh mesh;
+		if (!LoadObj(filename, mesh, false))
+			throw std::runtime_error("cannot load " + filename);
+		const std::vector<uint32_t>& faces = mesh.indices;
+		uint32_t numTriangles = faces.size() / 3;
+		auto getVertex = [&](uint32_t i) { return Vector3f(mesh.px[i], mesh.py[i], mesh.pz[i]); };
 
 		Vector3f min_vert = Vector3f{ std::numeric_limits<float>::infinity(),
 									 std::numeric_limits<float>::infinity(),
@@ -103,52 +149,100 @@ public:
 		Vector3f max_vert = Vector3f{ -std::numeric_limits<float>::infinity(),
 									 -std::numeric_limits<float>::infinity(),
 									 -std::numeric_limits<float>::infinity() };
-		for (int i = 0; i < mesh.Vertices.size(); i += 3) {
-			std::array<Vector3f, 3> face_vertices;
-
-			for (int j = 0; j < 3; j++) {
-				auto vert = Vector3f(mesh.Vertices[i + j].Position.X,
-					mesh.Vertices[i + j].Position.Y,
-					mesh.Vertices[i + j].Position.Z);
-				face_vertices[j] = vert;
-
-				min_vert = Vector3f(std::min(min_vert.x, vert.x),
-					std::min(min_vert.y, vert.y),
-					std::min(min_vert.z, vert.z));
-				max_vert = Vector3f(std::max(max_vert.x, vert.x),
-					std::max(max_vert.y, vert.y),
-					std::max(max_vert.z, vert.z));
-			}
-
-			triangles.emplace_back(face_vertices[0], face_vertices[1], face_vertices[2], mt);
+		std::vector<Bounds3> triangleBounds(numTriangles);
+		std::vector<float> triangleAreas(numTriangles);
+		for (uint32_t k = 0; k < numTriangles; ++k) {
+			Vector3f v0 = getVertex(faces[k * 3]), v1 = getVertex(faces[k * 3 + 1]), v2 = getVertex(faces[k * 3 + 2]);
+			triangleBounds[k] = Union(Bounds3(v0, v1), v2);
+			triangleAreas[k] = crossProduct(v1 - v0, v2 - v0).norm() * 0.5f;
+			min_vert = Vector3f::Min(min_vert, triangleBounds[k].pMin);
+			max_vert = Vector3f::Max(max_vert, triangleBounds[k].pMax);
 		}
 
-		bounding_box = Bounds3(min_vert, max_vert);
+		// The batched leaf test makes a few more triangles per leaf cheaper than another traversal step
+		BVHAccel bvh(triangleBounds, maxTrianglesInLeaf, BVHAccel::SplitMethod::SAH, bvhTraversalCost);
 
-		std::vector<Object*> ptrs;
-		for (auto& tri : triangles) {
-			ptrs.push_back(&tri);
-			area += tri.area;
+		// Store the triangles in leaf order, so every leaf reads one contiguous run of vertexIndex
+		std::vector<uint32_t> vertexIndex(faces.size());
+		std::vector<float> areaCdf(numTriangles);
+		std::vector<float> edges[9]; // v0x, v0y, v0z, e1x, e1y, e1z, e2x, e2y, e2z
+		for (auto& e : edges)
+			e.resize(numTriangles);
+		float area = 0;
+		for (uint32_t k = 0; k < numTriangles; ++k) {
+			int original = bvh.primitiveOrder[k];
+			for (int j = 0; j < 3; ++j)
+				vertexIndex[k * 3 + j] = faces[original * 3 + j];
+			area += triangleAreas[original];
+			areaCdf[k] = area;
+
+			Vector3f v0 = getVertex(vertexIndex[k * 3]), v1 = getVertex(vertexIndex[k * 3 + 1]), v2 = getVertex(vertexIndex[k * 3 + 2]);
+			Vector3f e1 = v1 - v0, e2 = v2 - v0;
+			const float values[9] = { v0.x, v0.y, v0.z, e1.x, e1.y, e1.z, e2.x, e2.y, e2.z };
+			for (int i = 0; i < 9; ++i)
+				edges[i][k] = values[i];
 		}
-		bvh = new BVHAccel(ptrs);
+
+		MeshCache::Header header = {};
+		header.triangleCount = numTriangles;
+		header.source = stamp;
+		header.maxPrimsInNode = maxTrianglesInLeaf;
+		header.traversalCost = bvhTraversalCost;
+		header.area = area;
+		const float bounds[6] = { min_vert.x, min_vert.y, min_vert.z, max_vert.x, max_vert.y, max_vert.z };
+		std::copy(bounds, bounds + 3, header.boundsMin);
+		std::copy(bounds + 3, bounds + 6, header.boundsMax);
+		auto section = [](const auto& v) { return std::pair<const void*, size_t>(v.data(), v.size() * sizeof(v[0])); };
+		std::pair<const void*, size_t> sections[MeshCache::SectionCount] = {
+			section(mesh.px), section(mesh.py), section(mesh.pz),
+			section(vertexIndex), section(areaCdf),
+			section(edges[0]), section(edges[1]), section(edges[2]),
+			section(edges[3]), section(edges[4]), section(edges[5]),
+			section(edges[6]), section(edges[7]), section(edges[8]),
+			section(bvh.nodes)
+		};
+		return std::unique_ptr<MeshCache>(new MeshCache(header, sections));
 	}
 
-	bool intersect(const Ray& ray) { return true; }
+	// Any hit before ray.t_max, the traversal stops at the first leaf that has one
+	bool intersect(const Ray& ray)
+	{
+		bool occluded = false;
+		float tMax = ray.maxDistance();
+		bvh->Traverse(ray, tMax, [&](const LinearBVHNode& leaf, float& tMax) {
+			uint32_t index;
+			occluded = intersectTriangles(ray, leaf.primitivesOffset, leaf.nPrimitives, tMax, index);
+			return occluded;
+			});
+		return occluded;
+	}
+
+	int intersect(const RayPacket& packet, int mask)
+	{
+		float tMax[RayPacket::size];
+		for (int i = 0; i < RayPacket::size; ++i)
+			tMax[i] = packet.rays[i] ? packet.rays[i]->maxDistance() : 0.0f;
+
+		int occluded = 0;
+		bvh->TraversePacket(packet, mask, tMax, [&](const LinearBVHNode& leaf, int laneMask, float* tMax) {
+			for (int i = 0; i < RayPacket::size; ++i) {
+				uint32_t index;
+				if ((laneMask & (1 << i)) && intersectTriangles(*packet.rays[i], leaf.primitivesOffset, leaf.nPrimitives, tMax[i], index)) {
+					occluded |= 1 << i;
+					tMax[i] = -1.0f; // retire the lane, no box starts before it
+				}
+			}
+			});
+		return occluded;
+	}
 
 	bool intersect(const Ray& ray, float& tnear, uint32_t& index) const
 	{
 		bool intersect = false;
-		for (uint32_t k = 0; k < numTriangles; ++k) {
-			const Vector3f& v0 = vertices[vertexIndex[k * 3]];
-			const Vector3f& v1 = vertices[vertexIndex[k * 3 + 1]];
-			const Vector3f& v2 = vertices[vertexIndex[k * 3 + 2]];
-			float t, u, v;
-			if (rayTriangleIntersect(v0, v1, v2, ray.origin, ray.direction, t, u, v) && t < tnear) {
-				tnear = t;
-				index = k;
-				intersect |= true;
-			}
-		}
+		bvh->Traverse(ray, tnear, [&](const LinearBVHNode& leaf, float& tMax) {
+			intersect |= intersectTriangles(ray, leaf.primitivesOffset, leaf.nPrimitives, tMax, index);
+			return false;
+			});
 
 		return intersect;
 	}
@@ -157,16 +251,8 @@ public:
 
 	void getSurfaceProperties(const Vector3f& P, const Vector3f& I, const uint32_t& index, const Vector2f& uv, Vector3f& N, Vector2f& st) const
 	{
-		const Vector3f& v0 = vertices[vertexIndex[index * 3]];
-		const Vector3f& v1 = vertices[vertexIndex[index * 3 + 1]];
-		const Vector3f& v2 = vertices[vertexIndex[index * 3 + 2]];
-		Vector3f e0 = normalize(v1 - v0);
-		Vector3f e1 = normalize(v2 - v1);
-		N = normalize(crossProduct(e0, e1));
-		const Vector2f& st0 = stCoordinates[vertexIndex[index * 3]];
-		const Vector2f& st1 = stCoordinates[vertexIndex[index * 3 + 1]];
-		const Vector2f& st2 = stCoordinates[vertexIndex[index * 3 + 2]];
-		st = st0 * (1 - uv.x - uv.y) + st1 * uv.x + st2 * uv.y;
+		N = getNormal(index);
+		st = Vector2f(0);
 	}
 
 	Vector3f evalDiffuseColor(const Vector2f& st) const
@@ -180,16 +266,70 @@ public:
 	{
 		Intersection intersec;
 
-		if (bvh) {
-			intersec = bvh->Intersect(ray);
+		float tnear = std::numeric_limits<float>::infinity();
+		uint32_t index = 0;
+		if (intersect(ray, tnear, index))
+			intersec = makeIntersection(ray, tnear, index);
+
+		return intersec;
+	}
+
+	void getIntersections(const RayPacket& packet, int mask, Intersection* hits)
+	{
+		float tnear[RayPacket::size];
+		uint32_t index[RayPacket::size];
+		for (int i = 0; i < RayPacket::size; ++i)
+			tnear[i] = hits[i].happened ? hits[i].distance : std::numeric_limits<float>::infinity();
+
+		int hitMask = 0;
+		bvh->TraversePacket(packet, mask, tnear, [&](const LinearBVHNode& leaf, int laneMask, float* tMax) {
+			for (int i = 0; i < RayPacket::size; ++i) {
+				if ((laneMask & (1 << i)) && intersectTriangles(*packet.rays[i], leaf.primitivesOffset, leaf.nPrimitives, tMax[i], index[i]))
+					hitMask |= 1 << i;
+			}
+			});
+
+		for (int i = 0; i < RayPacket::size; ++i) {
+			if (hitMask & (1 << i))
+				hits[i] = makeIntersection(*packet.rays[i], tnear[i], index[i]);
 		}
+	}
 
+	Intersection makeIntersection(const Ray& ray, float tnear, uint32_t index)
+	{
+		Intersection intersec;
+		intersec.happened = true;
+		intersec.coords = ray(tnear);
+		intersec.normal = getNormal(index);
+		intersec.distance = tnear;
+		intersec.obj = this;
+		intersec.m = m;
+		intersec.emit = m->getEmission();
+		intersec.index = index;
 		return intersec;
 	}
 
 	void Sample(Intersection& pos, float& pdf)
 	{
-		bvh->Sample(pos, pdf);
+		// pick a triangle in proportion to its area, then a uniform point on it
+		float p = get_random_float() * area;
+		uint32_t k = std::min<uint32_t>(std::upper_bound(areaCdf.begin(), areaCdf.end(), p) - areaCdf.begin(), numTriangles - 1);
+		SampleEmitter(k, pos);
+		pdf = 1.0f / area;
+	}
+
+	uint32_t getEmitterCount() { return numTriangles; }
+	float getEmitterArea(uint32_t k) { return areaCdf[k] - (k > 0 ? areaCdf[k - 1] : 0.0f); }
+	Bounds3 getEmitterBounds(uint32_t k)
+	{
+		return Union(Bounds3(getVertex(vertexIndex[k * 3]), getVertex(vertexIndex[k * 3 + 1])), getVertex(vertexIndex[k * 3 + 2]));
+	}
+	void SampleEmitter(uint32_t k, Intersection& pos)
+	{
+		Vector3f v0 = getVertex(vertexIndex[k * 3]), v1 = getVertex(vertexIndex[k * 3 + 1]), v2 = getVertex(vertexIndex[k * 3 + 2]);
+		float x = std::sqrt(get_random_float()), y = get_random_float();
+		pos.coords = v0 * (1.0f - x) + v1 * (x * (1.0f - y)) + v2 * (x * y);
+		pos.normal = getNormal(k);
 		pos.emit = m->getEmission();
 	}
 	float getArea()
@@ -200,14 +340,79 @@ public:
 	{
 		return m->hasEmission();
 	}
+	Vector3f getEmission()
+	{
+		return m->getEmission();
+	}
+
+	void setBVHWidth(int width)
+	{
+		bvh->Widen(width);
+	}
+
+	Vector3f getVertex(uint32_t i) const { return Vector3f(vx[i], vy[i], vz[i]); }
+
+	Vector3f getNormal(uint32_t k) const
+	{
+		Vector3f v0 = getVertex(vertexIndex[k * 3]), v1 = getVertex(vertexIndex[k * 3 + 1]), v2 = getVertex(vertexIndex[k * 3 + 2]);
+		return normalize(crossProduct(v1 - v0, v2 - v0));
+	}
+
+	// Moller-Trumbore against the triangles [first, first + count), read from the leaf-ordered
+	// v0/e1/e2 arrays so the test is a branch-free loop over contiguous floats the compiler can
+	// vectorize. Back faces are culled, as in Triangle::getIntersection.
+	bool intersectTriangles(const Ray& ray, uint32_t first, int count, float& tnear, uint32_t& index) const
+	{
+		const float ox = ray.origin.x, oy = ray.origin.y, oz = ray.origin.z;
+		const float dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+		const float *p0x = &v0x[first], *p0y = &v0y[first], *p0z = &v0z[first];
+		const float *a1x = &e1x[first], *a1y = &e1y[first], *a1z = &e1z[first];
+		const float *a2x = &e2x[first], *a2y = &e2y[first], *a2z = &e2z[first];
+		float t[maxTrianglesInLeaf];
+		bool hit = false;
+		for (int base = 0; base < count; base += maxTrianglesInLeaf) {
+			int n = std::min(maxTrianglesInLeaf, count - base);
+			for (int k = 0; k < n; ++k) {
+				int i = base + k;
+				float px = dy * a2z[i] - dz * a2y[i];
+				float py = dz * a2x[i] - dx * a2z[i];
+				float pz = dx * a2y[i] - dy * a2x[i];
+				float det = a1x[i] * px + a1y[i] * py + a1z[i] * pz;
+				float invDet = 1.0f / (det >= EPSILON ? det : 1.0f);
+				float tx = ox - p0x[i], ty = oy - p0y[i], tz = oz - p0z[i];
+				float u = (tx * px + ty * py + tz * pz) * invDet;
+				float qx = ty * a1z[i] - tz * a1y[i];
+				float qy = tz * a1x[i] - tx * a1z[i];
+				float qz = tx * a1y[i] - ty * a1x[i];
+				float v = (dx * qx + dy * qy + dz * qz) * invDet;
+				float tk = (a2x[i] * qx + a2y[i] * qy + a2z[i] * qz) * invDet;
+				bool inside = det >= EPSILON && u >= 0 && u <= 1 && v >= 0 && u + v <= 1 && tk >= 0;
+				t[k] = inside ? tk : std::numeric_limits<float>::infinity();
+			}
+
+			for (int k = 0; k < n; ++k) {
+				if (t[k] < tnear) {
+					tnear = t[k];
+					index = first + base + k;
+					hit = true;
+				}
+			}
+		}
+		return hit;
+	}
 
 	Bounds3 bounding_box;
-	std::unique_ptr<Vector3f[]> vertices;
+	// holds all the arrays below and the BVH nodes
+	std::unique_ptr<MeshCache> cache;
+	// vertex positions as separate x/y/z arrays, shared by all triangles using them
+	ArrayView<float> vx, vy, vz;
 	uint32_t numTriangles;
-	std::unique_ptr<uint32_t[]> vertexIndex;
-	std::unique_ptr<Vector2f[]> stCoordinates;
-
-	std::vector<Triangle> triangles;
+	// three vertex ids per triangle, triangles in BVH leaf order
+	ArrayView<uint32_t> vertexIndex;
+	// running sum of triangle areas, for area-proportional sampling
+	ArrayView<float> areaCdf;
+	// first vertex and the two edges of every triangle, in the same order as vertexIndex
+	ArrayView<float> v0x, v0y, v0z, e1x, e1y, e1z, e2x, e2y, e2z;
 
 	BVHAccel* bvh;
 	float area;
@@ -215,7 +420,28 @@ public:
 	Material* m;
 };
 
-inline bool Triangle::intersect(const Ray& ray) { return true; }
+inline bool Triangle::intersect(const Ray& ray)
+{
+	// same test as getIntersection, without filling in the hit
+	if (dotProduct(ray.direction, normal) > 0)
+		return false;
+	Vector3f pvec = crossProduct(ray.direction, e2);
+	double det = dotProduct(e1, pvec);
+	if (fabs(det) < EPSILON)
+		return false;
+
+	double det_inv = 1. / det;
+	Vector3f tvec = ray.origin - v0;
+	double u = dotProduct(tvec, pvec) * det_inv;
+	if (u < 0 || u > 1)
+		return false;
+	Vector3f qvec = crossProduct(tvec, e1);
+	double v = dotProduct(ray.direction, qvec) * det_inv;
+	if (v < 0 || u + v > 1)
+		return false;
+	double t_tmp = dotProduct(e2, qvec) * det_inv;
+	return t_tmp >= 0 && t_tmp < ray.t_max;
+}
 inline bool Triangle::intersect(const Ray& ray, float& tnear, uint32_t& index) const
 {
 	return false;
@@ -247,6 +473,16 @@ inline Intersection Triangle::getIntersection(Ray ray)
 	t_tmp = dotProduct(e2, qvec) * det_inv;
 
 	// TODO find ray triangle intersection
+	if (t_tmp < 0)
+		return inter;
+
+	inter.happened = true;
+	inter.coords = ray(t_tmp);
+	inter.normal = normal;
+	inter.distance = t_tmp;
+	inter.obj = this;
+	inter.m = m;
+	inter.emit = m->getEmission();
 
 	return inter;
 }
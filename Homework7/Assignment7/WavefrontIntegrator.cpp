@@ -0,0 +1,145 @@
+//
+// Wavefront version of Scene::castRay: all paths of a tile advance one bounce per pass.
+//
+
+#include "WavefrontIntegrator.hpp"
+#include "Renderer.hpp"
+
+#include <algorithm>
+
+void PathQueue::clear()
+{
+	pixel.clear();
+	origin.clear();
+	direction.clear();
+	throughput.clear();
+	bsdfPdf.clear();
+	sampler.clear();
+}
+
+void PathQueue::push(uint32_t p, const Vector3f& o, const Vector3f& d, const Vector3f& beta, float pdf, const Sampler& s)
+{
+	pixel.push_back(p);
+	origin.push_back(o);
+	direction.push_back(d);
+	throughput.push_back(beta);
+	bsdfPdf.push_back(pdf);
+	sampler.push_back(s);
+}
+
+void WavefrontIntegrator::RenderTile(std::vector<Vector3f>& framebuffer, int x0, int y0, int x1, int y1, int spp, uint32_t seed)
+{
+	Camera camera(scene);
+	Sampler& sampler = GetThreadSampler();
+
+	// Same sample streams as Renderer::RenderTile, so the paths match castRay's one by one
+	paths.clear();
+	for (int j = y0; j < y1; ++j) {
+		for (int i = x0; i < x1; ++i) {
+			int m = j * scene.width + i;
+			Vector3f dir = camera.direction(i, j);
+			for (int k = 0; k < spp; k++) {
+				sampler.StartPixelSample(m, k, seed);
+				paths.push(m, camera.eye_pos, dir, Vector3f(1.0f / spp), 0.0f, sampler);
+			}
+		}
+	}
+
+	for (int depth = 0; paths.size() > 0; ++depth) {
+		Extend();
+		Shade(framebuffer, depth);
+		TraceShadowRays(framebuffer);
+		std::swap(paths, nextPaths);
+	}
+}
+
+void WavefrontIntegrator::Extend()
+{
+	size_t n = paths.size();
+	hits.assign(n, Intersection());
+
+	std::vector<Ray> rays;
+	rays.reserve(RayPacket::size);
+	for (size_t first = 0; first < n; first += RayPacket::size) {
+		int count = std::min<size_t>(RayPacket::size, n - first);
+		RayPacket packet;
+		rays.clear();
+		for (int l = 0; l < count; ++l) {
+			rays.emplace_back(paths.origin[first + l], paths.direction[first + l]);
+			packet.set(l, rays[l]);
+		}
+		scene.intersect(packet, &hits[first]);
+	}
+}
+
+void WavefrontIntegrator::Shade(std::vector<Vector3f>& framebuffer, int depth)
+{
+	nextPaths.clear();
+	shadowRays.clear();
+	shadowPixel.clear();
+	shadowRadiance.clear();
+
+	// Misses and lights end their path here, everything else is shaded below
+	shadeOrder.clear();
+	for (uint32_t i = 0; i < paths.size(); ++i) {
+		const Intersection& inter = hits[i];
+		if (!inter.happened)
+			continue;
+		// light sources found by a bounce share their light with the light samples by MIS
+		if (inter.m->hasEmission()) {
+			Ray ray(paths.origin[i], paths.direction[i]);
+			framebuffer[paths.pixel[i]] += paths.throughput[i] * scene.emitted(ray, inter, depth, paths.bsdfPdf[i]);
+			continue;
+		}
+		shadeOrder.push_back(i);
+	}
+	std::stable_sort(shadeOrder.begin(), shadeOrder.end(), [&](uint32_t a, uint32_t b) {
+		return hits[a].m->getType() < hits[b].m->getType();
+		});
+
+	Sampler& sampler = GetThreadSampler();
+	for (uint32_t i : shadeOrder) {
+		const Intersection& inter = hits[i];
+		Vector3f p = inter.coords;
+		Vector3f N = normalize(inter.normal);
+		Vector3f wo = paths.direction[i];
+		Material* m = inter.m;
+		sampler = paths.sampler[i];
+
+		// contribution from the light source, if the shadow ray gets through
+		LightSample lightSample = scene.sampleDirect(inter);
+		Vector3f L_dir = paths.throughput[i] * scene.directLight(wo, inter, lightSample);
+		if (L_dir.x > 0 || L_dir.y > 0 || L_dir.z > 0) {
+			shadowRays.push_back(lightSample.shadowRay());
+			shadowPixel.push_back(paths.pixel[i]);
+			shadowRadiance.push_back(L_dir);
+		}
+
+		// contribution from other reflectors
+		if (get_random_float() < scene.RussianRoulette) {
+			Vector3f wi = normalize(m->sample(wo, N));
+			float pdf = m->pdf(wo, wi, N);
+			if (pdf > EPSILON) {
+				Vector3f beta = paths.throughput[i] * m->eval(wo, wi, N) * dotProduct(wi, N)
+					/ pdf / scene.RussianRoulette;
+				nextPaths.push(paths.pixel[i], p, wi, beta, pdf * scene.RussianRoulette, sampler);
+			}
+		}
+	}
+}
+
+void WavefrontIntegrator::TraceShadowRays(std::vector<Vector3f>& framebuffer)
+{
+	size_t n = shadowRays.size();
+	for (size_t first = 0; first < n; first += RayPacket::size) {
+		int count = std::min<size_t>(RayPacket::size, n - first);
+		RayPacket packet;
+		for (int l = 0; l < count; ++l)
+			packet.set(l, shadowRays[first + l]);
+		int occluded = scene.intersectP(packet);
+		for (int l = 0; l < count; ++l) {
+			if (!(occluded & (1 << l)))
+				framebuffer[shadowPixel[first + l]] += shadowRadiance[first + l];
+		}
+	}
+}
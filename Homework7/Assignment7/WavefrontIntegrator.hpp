@@ -0,0 +1,58 @@
+//
+// Wavefront version of Scene::castRay: all paths of a tile advance one bounce per pass.
+//
+
+#pragma once
+
+#include "Scene.hpp"
+#include "Sampler.hpp"
+
+#include <vector>
+
+// Paths in flight, one array per field so every stage only streams over the fields it uses
+struct PathQueue
+{
+	std::vector<uint32_t> pixel;       // framebuffer index the path adds to
+	std::vector<Vector3f> origin, direction;
+	std::vector<Vector3f> throughput;  // product of f * cos / pdf so far, including 1 / spp
+	std::vector<float> bsdfPdf;        // pdf direction was sampled with, 0 for camera rays
+	std::vector<Sampler> sampler;      // each path carries its own random stream
+
+	size_t size() const { return pixel.size(); }
+	void clear();
+	void push(uint32_t p, const Vector3f& o, const Vector3f& d, const Vector3f& beta, float pdf, const Sampler& s);
+};
+
+// Instead of following one path to its end, the integrator queues every sample of a tile
+// and runs each stage as one loop over the whole queue:
+//   extend: closest hit of every path, traced in RayPackets
+//   shade:  grouped by material type, draws the light sample and the next direction
+//   shadow: any-hit test of the queued shadow rays, again in packets
+// The paths that survive Russian roulette form the queue of the next pass. Every path
+// draws its random numbers in the same order as castRay, so the two agree statistically.
+class WavefrontIntegrator
+{
+public:
+	explicit WavefrontIntegrator(const Scene& scene)
+		: scene(scene)
+	{
+	}
+
+	// Add the spp samples of every pixel in [x0, x1) x [y0, y1) to framebuffer
+	void RenderTile(std::vector<Vector3f>& framebuffer, int x0, int y0, int x1, int y1, int spp, uint32_t seed);
+
+private:
+	void Extend();
+	void Shade(std::vector<Vector3f>& framebuffer, int depth);
+	void TraceShadowRays(std::vector<Vector3f>& framebuffer);
+
+	const Scene& scene;
+	PathQueue paths, nextPaths;
+	std::vector<Intersection> hits;
+	// queue indices of the paths to shade, sorted by material type
+	std::vector<uint32_t> shadeOrder;
+	// pending shadow rays and the radiance each one adds if it reaches its light
+	std::vector<Ray> shadowRays;
+	std::vector<uint32_t> shadowPixel;
+	std::vector<Vector3f> shadowRadiance;
+};
@@ -0,0 +1,114 @@
+//
+// Wide (4- or 8-ary) BVH nodes, collapsed from the binary BVHAccel tree.
+//
+
+#ifndef RAYTRACING_WIDEBVH_H
+#define RAYTRACING_WIDEBVH_H
+
+#include "Ray.hpp"
+#include "Bounds3.hpp"
+
+#include <algorithm>
+#include <limits>
+#if defined(__SSE__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+// N child boxes stored as separate lanes, so one ray is tested against all of them
+// at once. bounds[0] holds the minimum and bounds[1] the maximum corner, per axis.
+template <int N>
+struct alignas(32) WideBVHNode
+{
+	float bounds[2][3][N];
+	// >= 0: index of a wide node, < 0: ~index of a leaf in BVHAccel::nodes
+	int child[N];
+
+	WideBVHNode()
+	{
+		// unused lanes get an inverted box that no ray can enter
+		for (int i = 0; i < N; ++i) {
+			for (int axis = 0; axis < 3; ++axis) {
+				bounds[0][axis][i] = std::numeric_limits<float>::infinity();
+				bounds[1][axis][i] = -std::numeric_limits<float>::infinity();
+			}
+			child[i] = 0;
+		}
+	}
+
+	void setChild(int i, const Bounds3& b, int c)
+	{
+		bounds[0][0][i] = b.pMin.x; bounds[0][1][i] = b.pMin.y; bounds[0][2][i] = b.pMin.z;
+		bounds[1][0][i] = b.pMax.x; bounds[1][1][i] = b.pMax.y; bounds[1][2][i] = b.pMax.z;
+		child[i] = c;
+	}
+};
+
+// Slab test of one ray against all N children of a node. Writes the entry distance of
+// every lane to tNear and returns a bit mask of the lanes hit before tMax.
+template <int N>
+inline int IntersectChildren(const WideBVHNode<N>& node, const Ray& ray, const std::array<int, 3>& dirIsNeg, float tMax, float* tNear)
+{
+	const float origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+	const float invDir[3] = { ray.direction_inv.x, ray.direction_inv.y, ray.direction_inv.z };
+	float tLeave[N];
+	for (int i = 0; i < N; ++i) {
+		tNear[i] = 0;
+		tLeave[i] = tMax;
+	}
+	for (int axis = 0; axis < 3; ++axis) {
+		const float* nearPlane = node.bounds[dirIsNeg[axis]][axis];
+		const float* farPlane = node.bounds[1 - dirIsNeg[axis]][axis];
+		for (int i = 0; i < N; ++i) {
+			tNear[i] = std::max(tNear[i], (nearPlane[i] - origin[axis]) * invDir[axis]);
+			tLeave[i] = std::min(tLeave[i], (farPlane[i] - origin[axis]) * invDir[axis]);
+		}
+	}
+	int mask = 0;
+	for (int i = 0; i < N; ++i)
+		mask |= (tNear[i] <= tLeave[i]) << i;
+	return mask;
+}
+
+#if defined(__SSE__)
+template <>
+inline int IntersectChildren<4>(const WideBVHNode<4>& node, const Ray& ray, const std::array<int, 3>& dirIsNeg, float tMax, float* tNear)
+{
+	const float origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+	const float invDir[3] = { ray.direction_inv.x, ray.direction_inv.y, ray.direction_inv.z };
+	__m128 enter = _mm_setzero_ps();
+	__m128 leave = _mm_set1_ps(tMax);
+	for (int axis = 0; axis < 3; ++axis) {
+		__m128 o = _mm_set1_ps(origin[axis]);
+		__m128 inv = _mm_set1_ps(invDir[axis]);
+		__m128 nearPlane = _mm_load_ps(node.bounds[dirIsNeg[axis]][axis]);
+		__m128 farPlane = _mm_load_ps(node.bounds[1 - dirIsNeg[axis]][axis]);
+		enter = _mm_max_ps(enter, _mm_mul_ps(_mm_sub_ps(nearPlane, o), inv));
+		leave = _mm_min_ps(leave, _mm_mul_ps(_mm_sub_ps(farPlane, o), inv));
+	}
+	_mm_storeu_ps(tNear, enter);
+	return _mm_movemask_ps(_mm_cmple_ps(enter, leave));
+}
+#endif
+
+#if defined(__AVX__)
+template <>
+inline int IntersectChildren<8>(const WideBVHNode<8>& node, const Ray& ray, const std::array<int, 3>& dirIsNeg, float tMax, float* tNear)
+{
+	const float origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+	const float invDir[3] = { ray.direction_inv.x, ray.direction_inv.y, ray.direction_inv.z };
+	__m256 enter = _mm256_setzero_ps();
+	__m256 leave = _mm256_set1_ps(tMax);
+	for (int axis = 0; axis < 3; ++axis) {
+		__m256 o = _mm256_set1_ps(origin[axis]);
+		__m256 inv = _mm256_set1_ps(invDir[axis]);
+		__m256 nearPlane = _mm256_load_ps(node.bounds[dirIsNeg[axis]][axis]);
+		__m256 farPlane = _mm256_load_ps(node.bounds[1 - dirIsNeg[axis]][axis]);
+		enter = _mm256_max_ps(enter, _mm256_mul_ps(_mm256_sub_ps(nearPlane, o), inv));
+		leave = _mm256_min_ps(leave, _mm256_mul_ps(_mm256_sub_ps(farPlane, o), inv));
+	}
+	_mm256_storeu_ps(tNear, enter);
+	return _mm256_movemask_ps(_mm256_cmp_ps(enter, leave, _CMP_LE_OQ));
+}
+#endif
+
+#endif //RAYTRACING_WIDEBVH_H
@@ -2,7 +2,12 @@
 
 #include <iostream>
 #include <cmath>
-#include <random>
+#include <limits>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include "Sampler.hpp"
 
 #undef M_PI
 #define M_PI 3.141592653589793f
@@ -10,6 +15,26 @@
 extern const float  EPSILON;
 const float kInfinity = std::numeric_limits<float>::max();
 
+// Read-only array stored elsewhere, in a std::vector or in a mapped file
+template <typename T>
+struct ArrayView
+{
+	ArrayView() = default;
+	ArrayView(const T* ptr, size_t count) : ptr(ptr), count(count) {}
+	ArrayView(const std::vector<T>& v) : ptr(v.data()), count(v.size()) {}
+
+	const T& operator[](size_t i) const { return ptr[i]; }
+	const T* data() const { return ptr; }
+	const T* begin() const { return ptr; }
+	const T* end() const { return ptr + count; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+private:
+	const T* ptr = nullptr;
+	size_t count = 0;
+};
+
 inline float clamp(const float& lo, const float& hi, const float& v)
 {
 	return std::max(lo, std::min(hi, v));
@@ -29,17 +54,18 @@ inline bool solveQuadratic(const float& a, const float& b, const float& c, float
 	return true;
 }
 
+// draws from the sampler of the calling thread, the renderer positions it at the
+// current pixel sample before tracing
 inline float get_random_float()
 {
-	std::random_device dev;
-	std::mt19937 rng(dev());
-	std::uniform_real_distribution<float> dist(0.f, 1.f); // distribution in range [1, 6]
-
-	return dist(rng);
+	return GetThreadSampler().Uniform();
 }
 
 inline void UpdateProgress(float progress)
 {
+	static std::mutex mutex;
+	std::lock_guard<std::mutex> lock(mutex);
+
 	int barWidth = 70;
 
 	std::cout << "[";
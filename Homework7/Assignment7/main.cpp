@@ -24,10 +24,15 @@ int main(int argc, char** argv)
 	white->Kd = Vector3f(0.725f, 0.71f, 0.68f);
 	Material* light = new Material(DIFFUSE, (8.0f * Vector3f(0.747f + 0.058f, 0.747f + 0.258f, 0.747f) + 15.6f * Vector3f(0.740f + 0.287f, 0.740f + 0.160f, 0.740f) + 18.4f * Vector3f(0.737f + 0.642f, 0.737f + 0.159f, 0.737f)));
 	light->Kd = Vector3f(0.65f);
+	// white under a rough specular coat
+	Material* glossy = new Material(MICROFACET, Vector3f(0.0f));
+	glossy->Kd = Vector3f(0.6f, 0.59f, 0.56f);
+	glossy->Ks = Vector3f(0.3f);
+	glossy->roughness = 0.3f;
 
 	MeshTriangle floor("../models/cornellbox/floor.obj", white);
 	MeshTriangle shortbox("../models/cornellbox/shortbox.obj", white);
-	MeshTriangle tallbox("../models/cornellbox/tallbox.obj", white);
+	MeshTriangle tallbox("../models/cornellbox/tallbox.obj", glossy);
 	MeshTriangle left("../models/cornellbox/left.obj", red);
 	MeshTriangle right("../models/cornellbox/right.obj", green);
 	MeshTriangle light_("../models/cornellbox/light.obj", light);